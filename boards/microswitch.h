@@ -0,0 +1,34 @@
+/* ========================================================================
+   $File: microswitch $
+   $Notice: Board description; matrix wiring of the MicroSwitch controller. $
+   ======================================================================== */
+
+/*
+  A board description gives the matrix wiring the firmware is built for;
+  select one with -DBOARD='"boards/<name>.h"'. The scan selects a column
+  by writing its number to the address bits of SC_ADDR_PORT, enables the
+  column decoder by pulling the SC_STROBE bit low, and reads the rows,
+  active low, from SC_KEYS_PIN.
+
+  The unrolled scan (-DSCAN_UNROLLED) writes whole port values rather
+  than changing single bits, so it needs the strobe on the address port,
+  and SC_PORT_REST gives the level of that port's other pins.
+*/
+
+#ifndef BOARD_H
+#define BOARD_H
+
+// 16 columns on a 4-to-16 decoder: address on PB4..PB7, enable on PB0.
+#define SC_COLUMNS 16
+#define SC_ADDR_DDR DDRB
+#define SC_ADDR_PORT PORTB
+#define SC_ADDR_SHIFT 4
+#define SC_ADDR_MASK 0x0F
+#define SC_STROBE_DDR DDRB
+#define SC_STROBE_PORT PORTB
+#define SC_STROBE (1 << 0)
+#define SC_PORT_REST 0x00       // PB1..PB3 unused, inputs without pull-up.
+#define SC_KEYS_PIN PIND
+#define SC_SETTLE_US 5
+
+#endif
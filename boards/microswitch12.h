@@ -0,0 +1,28 @@
+/* ========================================================================
+   $File: microswitch12 $
+   $Notice: Board description; MicroSwitch wiring with 12 columns fitted. $
+   ======================================================================== */
+
+/*
+  The MicroSwitch controller's wiring with only the first 12 decoder
+  outputs in use. It builds and checks the paths that only run when
+  SC_COLUMNS is below 16; see boards/microswitch.h for the fields.
+*/
+
+#ifndef BOARD_H
+#define BOARD_H
+
+// 12 columns on a 4-to-16 decoder: address on PB4..PB7, enable on PB0.
+#define SC_COLUMNS 12
+#define SC_ADDR_DDR DDRB
+#define SC_ADDR_PORT PORTB
+#define SC_ADDR_SHIFT 4
+#define SC_ADDR_MASK 0x0F
+#define SC_STROBE_DDR DDRB
+#define SC_STROBE_PORT PORTB
+#define SC_STROBE (1 << 0)
+#define SC_PORT_REST 0x00       // PB1..PB3 unused, inputs without pull-up.
+#define SC_KEYS_PIN PIND
+#define SC_SETTLE_US 5
+
+#endif
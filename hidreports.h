@@ -0,0 +1,267 @@
+/* ========================================================================
+   $File: hidreports $
+   $Notice: HID report layouts and report descriptors of the keyboard. $
+   ======================================================================== */
+
+/*
+  Every report the firmware sends or takes, and the report descriptor
+  items that describe them, for micro_boardfinal.c and for Descriptors.c,
+  which builds with the same build options. Include it after LUFA.
+  Multi-byte fields are little-endian.
+
+  The keyboard interface (INTERFACE_ID_Keyboard) serves
+  HID_DESCRIPTOR_MICROSWITCH_KEYBOARD as its report descriptor:
+
+    const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
+    {
+      HID_DESCRIPTOR_MICROSWITCH_KEYBOARD
+    };
+
+  It holds the boot-layout keyboard and the reports of every option built
+  in, each with its own report ID, since HID does not allow reports with
+  and without IDs in one descriptor. In boot protocol the host ignores the
+  descriptor and the boot report goes out bare; in report protocol it
+  carries KEYBOARD_REPORT_ID, so KEYBOARD_EPSIZE must be at least 9, or
+  NKRO_REPORT_SIZE + 1 with -DNKRO_REPORT.
+
+  With -DRAW_EVENTS the raw interface (INTERFACE_ID_RawHID) serves
+  HID_DESCRIPTOR_MICROSWITCH_RAW_EVENTS, whose one report has no ID.
+*/
+
+#ifndef HIDREPORTS_H
+#define HIDREPORTS_H
+
+#define KEYBOARD_REPORT_ID  1   // Boot layout, LEDs, and the mode Feature report.
+#define NKRO_REPORT_ID      2
+#define TELEMETRY_REPORT_ID 3
+#define SETTLE_REPORT_ID    4
+#define TRACE_REPORT_ID     5
+#define KEYMAP_REPORT_ID    6
+
+// Keyboard page usages the keyboard can send: everything below the
+// locking keys' end of the table, 0x00..0x9F. The boot report's key array
+// and the NKRO bitmap cover the same range.
+#define KEYBOARD_USAGES     0xA0
+
+// Mode Feature report: a count of translation modes (always 1), the
+// translation mode, and the report format (see ReportFormat).
+#define MODE_REPORT_SIZE    3
+
+// N-key rollover report (-DNKRO_REPORT): the modifier byte, then one bit
+// per usage below KEYBOARD_USAGES.
+#define NKRO_REPORT_SIZE    (1 + KEYBOARD_USAGES / 8)
+
+typedef struct
+{
+  uint8_t Modifier;
+  uint8_t Bits[NKRO_REPORT_SIZE - 1];
+} ATTR_PACKED USB_KeyboardNKROReport_Data_t;
+
+// Telemetry Feature report: read-only counters for monitoring boards in
+// the field, e.g. with HIDIOCGFEATURE on report ID TELEMETRY_REPORT_ID.
+// Bump TELEMETRY_VERSION whenever the layout changes.
+#define TELEMETRY_VERSION 2
+#define TELEMETRY_FLAG_LATENCY (1 << 0)     // LatencyHist is populated.
+#define TELEMETRY_FLAG_BOOT    (1 << 1)     // Boot timings are final.
+
+typedef struct
+{
+  uint8_t Version;
+  uint8_t Flags;
+  uint32_t ScansPerSec;         // Over the last full second of SOFs.
+  uint32_t PressEvents;
+  uint32_t ReleaseEvents;
+  uint32_t DebounceSuppressed;  // Bounces the debouncer swallowed.
+  uint16_t RolloverReports;     // Boot reports sent with ERROR_ROLLOVER,
+                                // interrupt pipe only.
+  uint16_t EventOverflows;
+  uint16_t ColumnChatter[16];   // Scans with a suppressed bounce, per column.
+  uint16_t LatencyHist[16];
+  uint32_t BootConfiguredUs;    // Timer1 start to USB configuration.
+  uint32_t BootReportUs;        // Timer1 start to the first IN report.
+} ATTR_PACKED TelemetryReport_t;
+
+// Settle table (-DSETTLE_CALIBRATE), as kept in EEPROM: GET_REPORT
+// returns it, any SET_REPORT starts a recalibration.
+typedef struct
+{
+  uint8_t magic;
+  uint8_t ticks[16];
+  uint8_t check;                // Sum of ticks[], inverted.
+} SettleTable;
+
+// Scan trace sample; a trace file is TRACE_MAGIC followed by samples.
+#define TRACE_MAGIC "MKT1"
+
+typedef struct
+{
+  uint16_t Ticks;               // HAL_Ticks() at the start of the scan.
+  uint16_t Scans;               // Scans since the previous sample, >= 1.
+  uint8_t Matrix[16];
+} ATTR_PACKED TraceSample;
+
+// Trace report (-DTRACE_RECORD): each GET pops one sample.
+typedef struct
+{
+  uint8_t Count;                // Samples left, this one included; 0 = none.
+  uint8_t Flags;                // TRACE_FLAG_ARMED | TRACE_FLAG_FULL.
+  TraceSample Sample;
+} ATTR_PACKED TraceReport_t;
+
+// Keymap report (-DKEYMAP_EEPROM). SET carries an op; GET returns the
+// status, the live keymap's checksum and the entries at the read cursor.
+#define KEYMAP_ENTRIES_PER_REPORT 8
+
+typedef struct
+{
+  uint8_t Code;                 // KEYMAP_OP_* on SET, KEYMAP_STATUS_* on GET.
+  uint8_t Layer;
+  uint8_t Position;
+  uint8_t Count;                // Entries used.
+  uint16_t Check;               // COMMIT: staged checksum; GET: live one.
+  uint16_t Entries[KEYMAP_ENTRIES_PER_REPORT];  // KeyEntry, as in keymap.h.
+} ATTR_PACKED KeymapReport_t;
+
+// Raw event report (-DRAW_EVENTS), on its own interface. Each holds up to
+// RAW_EVENTS_PER_REPORT events; Sequence counts reports so the host can
+// spot lost ones, and Dropped counts events lost to a full ring since the
+// previous report. A GET_REPORT on the control pipe takes no events: it
+// has Count 0 and the Sequence of the next report. tools/rawevents.h
+// mirrors it.
+#define RAW_EVENTS_VERSION 1
+#define RAW_EVENTS_PER_REPORT 12
+
+typedef struct
+{
+  uint8_t Code;                 // Matrix position, | KEY_EVENT_UP.
+  uint32_t Usec;
+} ATTR_PACKED RawEvent_t;
+
+typedef struct
+{
+  uint8_t Version;
+  uint8_t Sequence;
+  uint8_t Count;                // Valid entries in Events.
+  uint8_t Dropped;
+  RawEvent_t Events[RAW_EVENTS_PER_REPORT];
+} ATTR_PACKED RawEventsReport_t;
+
+// Boot-layout keyboard with LED output, as LUFA's HID_DESCRIPTOR_KEYBOARD
+// but with a report ID, plus the mode Feature report.
+#define HID_DESCRIPTOR_KEYBOARD_BOOT(id)                                \
+  HID_RI_USAGE_PAGE(8, 0x01),                                           \
+  HID_RI_USAGE(8, 0x06),                                                \
+  HID_RI_COLLECTION(8, 0x01),                                           \
+    HID_RI_REPORT_ID(8, id),                                            \
+    HID_RI_USAGE_PAGE(8, 0x07),                                         \
+    HID_RI_USAGE_MINIMUM(8, 0xE0),                                      \
+    HID_RI_USAGE_MAXIMUM(8, 0xE7),                                      \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(8, 0x01),                                    \
+    HID_RI_REPORT_SIZE(8, 0x01),                                        \
+    HID_RI_REPORT_COUNT(8, 0x08),                                       \
+    HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+    HID_RI_REPORT_COUNT(8, 0x01),                                       \
+    HID_RI_REPORT_SIZE(8, 0x08),                                        \
+    HID_RI_INPUT(8, HID_IOF_CONSTANT),                                  \
+    HID_RI_USAGE_PAGE(8, 0x08),                                         \
+    HID_RI_USAGE_MINIMUM(8, 0x01),                                      \
+    HID_RI_USAGE_MAXIMUM(8, 0x05),                                      \
+    HID_RI_REPORT_COUNT(8, 0x05),                                       \
+    HID_RI_REPORT_SIZE(8, 0x01),                                        \
+    HID_RI_OUTPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+    HID_RI_REPORT_COUNT(8, 0x01),                                       \
+    HID_RI_REPORT_SIZE(8, 0x03),                                        \
+    HID_RI_OUTPUT(8, HID_IOF_CONSTANT),                                 \
+    HID_RI_USAGE_PAGE(8, 0x07),                                         \
+    HID_RI_USAGE_MINIMUM(8, 0x00),                                      \
+    HID_RI_USAGE_MAXIMUM(8, KEYBOARD_USAGES - 1),                       \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(16, KEYBOARD_USAGES - 1),                    \
+    HID_RI_REPORT_COUNT(8, 0x06),                                       \
+    HID_RI_REPORT_SIZE(8, 0x08),                                        \
+    HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_ARRAY | HID_IOF_ABSOLUTE),   \
+    HID_RI_USAGE_PAGE(16, 0xFF00),                                      \
+    HID_RI_USAGE(8, 0x09),                                              \
+    HID_RI_LOGICAL_MAXIMUM(16, 0x00FF),                                 \
+    HID_RI_REPORT_COUNT(8, MODE_REPORT_SIZE),                           \
+    HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+  HID_RI_END_COLLECTION(0)
+
+#define HID_DESCRIPTOR_KEYBOARD_NKRO(id)                                \
+  HID_RI_USAGE_PAGE(8, 0x01),                                           \
+  HID_RI_USAGE(8, 0x06),                                                \
+  HID_RI_COLLECTION(8, 0x01),                                           \
+    HID_RI_REPORT_ID(8, id),                                            \
+    HID_RI_USAGE_PAGE(8, 0x07),                                         \
+    HID_RI_USAGE_MINIMUM(8, 0xE0),                                      \
+    HID_RI_USAGE_MAXIMUM(8, 0xE7),                                      \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(8, 0x01),                                    \
+    HID_RI_REPORT_SIZE(8, 0x01),                                        \
+    HID_RI_REPORT_COUNT(8, 0x08),                                       \
+    HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+    HID_RI_USAGE_MINIMUM(8, 0x00),                                      \
+    HID_RI_USAGE_MAXIMUM(8, KEYBOARD_USAGES - 1),                       \
+    HID_RI_REPORT_COUNT(8, KEYBOARD_USAGES),                            \
+    HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+  HID_RI_END_COLLECTION(0)
+
+// A vendor-defined collection holding one Feature report of 'size' bytes.
+#define HID_DESCRIPTOR_VENDOR_FEATURE(id, usage, size)                  \
+  HID_RI_USAGE_PAGE(16, 0xFF00),                                        \
+  HID_RI_USAGE(8, usage),                                               \
+  HID_RI_COLLECTION(8, 0x01),                                           \
+    HID_RI_REPORT_ID(8, id),                                            \
+    HID_RI_USAGE(8, (usage) + 1),                                       \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(16, 0x00FF),                                 \
+    HID_RI_REPORT_SIZE(8, 0x08),                                        \
+    HID_RI_REPORT_COUNT(8, size),                                       \
+    HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+  HID_RI_END_COLLECTION(0)
+
+#define HID_DESCRIPTOR_TELEMETRY(id) \
+  HID_DESCRIPTOR_VENDOR_FEATURE(id, 0x01, sizeof(TelemetryReport_t))
+#define HID_DESCRIPTOR_SETTLE(id) \
+  HID_DESCRIPTOR_VENDOR_FEATURE(id, 0x03, sizeof(SettleTable))
+#define HID_DESCRIPTOR_TRACE(id) \
+  HID_DESCRIPTOR_VENDOR_FEATURE(id, 0x05, sizeof(TraceReport_t))
+#define HID_DESCRIPTOR_KEYMAP(id) \
+  HID_DESCRIPTOR_VENDOR_FEATURE(id, 0x07, sizeof(KeymapReport_t))
+
+// The optional parts of the keyboard interface's descriptor, each with
+// its trailing comma, or nothing when the option is not built in.
+#ifdef NKRO_REPORT
+#define HID_REPORTS_NKRO HID_DESCRIPTOR_KEYBOARD_NKRO(NKRO_REPORT_ID),
+#else
+#define HID_REPORTS_NKRO
+#endif
+#ifdef SETTLE_CALIBRATE
+#define HID_REPORTS_SETTLE HID_DESCRIPTOR_SETTLE(SETTLE_REPORT_ID),
+#else
+#define HID_REPORTS_SETTLE
+#endif
+#ifdef TRACE_RECORD
+#define HID_REPORTS_TRACE HID_DESCRIPTOR_TRACE(TRACE_REPORT_ID),
+#else
+#define HID_REPORTS_TRACE
+#endif
+#ifdef KEYMAP_EEPROM
+#define HID_REPORTS_KEYMAP HID_DESCRIPTOR_KEYMAP(KEYMAP_REPORT_ID),
+#else
+#define HID_REPORTS_KEYMAP
+#endif
+
+#define HID_DESCRIPTOR_MICROSWITCH_KEYBOARD                             \
+  HID_DESCRIPTOR_KEYBOARD_BOOT(KEYBOARD_REPORT_ID),                     \
+  HID_REPORTS_NKRO                                                      \
+  HID_REPORTS_SETTLE                                                    \
+  HID_REPORTS_TRACE                                                     \
+  HID_REPORTS_KEYMAP                                                    \
+  HID_DESCRIPTOR_TELEMETRY(TELEMETRY_REPORT_ID)
+
+#define HID_DESCRIPTOR_MICROSWITCH_RAW_EVENTS \
+  HID_DESCRIPTOR_VENDOR(0x00, 0x01, 0x02, 0x03, sizeof(RawEventsReport_t))
+
+#endif
@@ -0,0 +1,199 @@
+/* Generated by tools/keymapgen from host/checkmap.txt. Do not edit. */
+
+#define KEY_LAYERS 1
+#define KEY_CHORDS 2
+#define KEY_MACROS 1
+
+static const KeyEntry Keys[KEY_LAYERS][128] PROGMEM = {
+  { /* layer 0: host/checkmap.txt */
+    /* 000 */ KEY_ENTRY(HID_KEYBOARD_SC_DOT_AND_GREATER_THAN_SIGN, NONE), // >
+    /* 001 */ KEY_ENTRY(HID_KEYBOARD_SC_SEMICOLON_AND_COLON, NONE), // HELP
+    /* 002 */ KEY_ENTRY(HID_KEYBOARD_SC_P, NONE),
+    /* 003 */ KEY_ENTRY(HID_KEYBOARD_SC_0_AND_CLOSING_PARENTHESIS, NONE), // CAPS-LOCK
+    /* 004 */ KEY_ENTRY(HID_KEYBOARD_SC_COMMA_AND_LESS_THAN_SIGN, NONE), // BOLD-LOCK (shift key? LED?)
+    /* 005 */ KEY_ENTRY(HID_KEYBOARD_SC_L, NONE), // l
+    /* 006 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE), // O
+    /* 007 */ KEY_ENTRY(HID_KEYBOARD_SC_9_AND_OPENING_PARENTHESIS, NONE), // 9
+    /* 010 */ KEY_ENTRY(HID_KEYBOARD_SC_SPACE, NONE),
+    /* 011 */ KEY_ENTRY(HID_KEYBOARD_SC_Z, NONE),
+    /* 012 */ KEY_ENTRY(HID_KEYBOARD_SC_LOCKING_NUM_LOCK, ALT_LOCK), // broken key numlock
+    /* 013 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_9_AND_PAGE_UP, NONE), // 9 and )
+    /* 014 */ KEY_ENTRY(HID_KEYBOARD_SC_Z, NONE),
+    /* 015 */ KEY_ENTRY(HID_KEYBOARD_SC_A, NONE), // A
+    /* 016 */ KEY_ENTRY(HID_KEYBOARD_SC_Q, NONE), // Q
+    /* 017 */ KEY_ENTRY(HID_KEYBOARD_SC_1_AND_EXCLAMATION, NONE), // 1 and !
+    /* 020 */ KEY_ENTRY(HID_KEYBOARD_SC_TAB, NONE), // TAB
+    /* 021 */ KEY_ENTRY(HID_KEYBOARD_SC_X, NONE),
+    /* 022 */ KEY_ENTRY(HID_KEYBOARD_SC_Y, NONE),
+    /* 023 */ KEY_ENTRY(HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NONE), // `
+    /* 024 */ KEY_ENTRY(HID_KEYBOARD_SC_V, NONE), // V
+    /* 025 */ KEY_ENTRY(HID_KEYBOARD_SC_G, NONE), // G
+    /* 026 */ KEY_ENTRY(HID_KEYBOARD_SC_T, NONE), // T
+    /* 027 */ KEY_ENTRY(HID_KEYBOARD_SC_5_AND_PERCENTAGE, NONE), // F4
+    /* 030 */ KEY_ENTRY(HID_KEYBOARD_SC_G, NONE),
+    /* 031 */ KEY_ENTRY(HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NONE), // nothing
+    /* 032 */ KEY_ENTRY(HID_KEYBOARD_SC_I, NONE),
+    /* 033 */ KEY_ENTRY(HID_KEYBOARD_SC_3_AND_HASHMARK, NONE), // 3 and pound
+    /* 034 */ KEY_ENTRY(HID_KEYBOARD_SC_6_AND_CARET, NONE), // LEFT-CONTROL
+    /* 035 */ KEY_ENTRY(HID_KEYBOARD_SC_HOME, NONE), // RIGHT-CONTROL
+    /* 036 */ KEY_ENTRY(HID_KEYBOARD_SC_Y, NONE), // Y
+    /* 037 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE),
+    /* 040 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE),
+    /* 041 */ KEY_ENTRY(HID_KEYBOARD_SC_BACKSLASH_AND_PIPE, NONE), // num lock ??
+    /* 042 */ KEY_ENTRY(HID_KEYBOARD_SC_CLOSING_BRACKET_AND_CLOSING_BRACE, NONE),
+    /* 043 */ KEY_ENTRY(HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NONE), // ALT (ESCAPE actually?)
+    /* 044 */ KEY_ENTRY(HID_KEYBOARD_SC_N, NONE), // N
+    /* 045 */ KEY_ENTRY(HID_KEYBOARD_SC_J, NONE), // J
+    /* 046 */ KEY_ENTRY(HID_KEYBOARD_SC_U, NONE), // U
+    /* 047 */ KEY_ENTRY(HID_KEYBOARD_SC_7_AND_AMPERSAND, NONE), // 7 and backtick
+    /* 050 */ KEY_ENTRY(HID_KEYBOARD_SC_B, NONE),
+    /* 051 */ KEY_ENTRY(HID_KEYBOARD_SC_C, NONE),
+    /* 052 */ KEY_ENTRY(HID_KEYBOARD_SC_D, NONE),
+    /* 053 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE), // broken Key
+    /* 054 */ KEY_ENTRY(HID_KEYBOARD_SC_E, NONE),
+    /* 055 */ KEY_ENTRY(HID_KEYBOARD_SC_F, NONE),
+    /* 056 */ KEY_ENTRY(HID_KEYBOARD_SC_G, NONE),
+    /* 057 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_ASTERISK, NONE), // nothing
+    /* 060 */ KEY_ENTRY(HID_KEYBOARD_SC_I, NONE),
+    /* 061 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_2_AND_DOWN_ARROW, NONE), // 2
+    /* 062 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_5, NONE), // 5
+    /* 063 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_7_AND_HOME, NONE), // 7
+    /* 064 */ KEY_ENTRY(HID_KEYBOARD_SC_X, NONE), // D
+    /* 065 */ KEY_ENTRY(HID_KEYBOARD_SC_D, NONE), // X
+    /* 066 */ KEY_ENTRY(HID_KEYBOARD_SC_E, NONE), // E
+    /* 067 */ KEY_ENTRY(HID_KEYBOARD_SC_3_AND_HASHMARK, NONE), // num 3
+    /* 070 */ KEY_ENTRY(HID_KEYBOARD_SC_K, NONE),
+    /* 071 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE),
+    /* 072 */ KEY_ENTRY(HID_KEYBOARD_SC_F14, NONE), // f14
+    /* 073 */ KEY_ENTRY(HID_KEYBOARD_SC_F13, NONE), // f13
+    /* 074 */ KEY_ENTRY(HID_KEYBOARD_SC_F12, NONE), // f12
+    /* 075 */ KEY_ENTRY(HID_KEYBOARD_SC_F11, NONE), // f11
+    /* 076 */ KEY_ENTRY(HID_KEYBOARD_SC_F10, NONE), // F10
+    /* 077 */ KEY_ENTRY(HID_KEYBOARD_SC_F9, NONE), // F9
+    /* 100 */ KEY_ENTRY(HID_KEYBOARD_SC_SLASH_AND_QUESTION_MARK, NONE), // forward slash
+    /* 101 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_ASTERISK, NONE), // check is this real b??
+    /* 102 */ KEY_ENTRY(HID_KEYBOARD_SC_OPENING_BRACKET_AND_OPENING_BRACE, NONE), // Bracket
+    /* 103 */ KEY_ENTRY(HID_KEYBOARD_SC_B, NONE), // B
+    /* 104 */ KEY_ENTRY(HID_KEYBOARD_SC_M, NONE), // M
+    /* 105 */ KEY_ENTRY(HID_KEYBOARD_SC_K, NONE), // K
+    /* 106 */ KEY_ENTRY(HID_KEYBOARD_SC_I, NONE), // I
+    /* 107 */ KEY_ENTRY(HID_KEYBOARD_SC_8_AND_ASTERISK, NONE), // 8
+    /* 110 */ KEY_ENTRY(HID_KEYBOARD_SC_RIGHT_GUI, R_SUPER), // right shift
+    /* 111 */ KEY_ENTRY(HID_KEYBOARD_SC_RIGHT_ALT, R_META), // rept
+    /* 112 */ KEY_ENTRY(HID_KEYBOARD_SC_LEFT_CONTROL, L_CONTROL), // left control
+    /* 113 */ KEY_ENTRY(HID_KEYBOARD_SC_K, NONE),
+    /* 114 */ KEY_ENTRY(HID_KEYBOARD_SC_LEFT_SHIFT, L_SHIFT), // SHIFT
+    /* 115 */ KEY_ENTRY(HID_KEYBOARD_SC_RIGHT_SHIFT, R_SHIFT), // SHIFT LOCK
+    /* 116 */ KEY_ENTRY(HID_KEYBOARD_SC_TAB, NONE), // TAB
+    /* 117 */ KEY_ENTRY(HID_KEYBOARD_SC_CAPS_LOCK, CAPS_LOCK), // caps lock
+    /* 120 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_0_AND_INSERT, NONE), // num 0
+    /* 121 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_1_AND_END, NONE), // num 1
+    /* 122 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_4_AND_LEFT_ARROW, NONE), // num 4
+    /* 123 */ KEY_ENTRY(HID_KEYBOARD_SC_M, NONE),
+    /* 124 */ KEY_ENTRY(HID_KEYBOARD_SC_C, NONE), // C
+    /* 125 */ KEY_ENTRY(HID_KEYBOARD_SC_F, NONE), // F
+    /* 126 */ KEY_ENTRY(HID_KEYBOARD_SC_R, NONE), // R
+    /* 127 */ KEY_ENTRY(HID_KEYBOARD_SC_4_AND_DOLLAR, NONE), // num 4
+    /* 130 */ KEY_ENTRY(HID_KEYBOARD_SC_X, NONE),
+    /* 131 */ KEY_ENTRY(HID_KEYBOARD_SC_Y, NONE),
+    /* 132 */ KEY_ENTRY(HID_KEYBOARD_SC_Z, NONE),
+    /* 133 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE),
+    /* 134 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_2_AND_DOWN_ARROW, NONE), // down
+    /* 135 */ KEY_ENTRY(HID_KEYBOARD_SC_N, NONE),
+    /* 136 */ KEY_ENTRY(HID_KEYBOARD_SC_BACKSPACE, NONE),
+    /* 137 */ KEY_ENTRY(HID_KEYBOARD_SC_P, NONE),
+    /* 140 */ KEY_ENTRY(HID_KEYBOARD_SC_LEFT_ARROW, NONE),
+    /* 141 */ KEY_ENTRY(HID_KEYBOARD_SC_ENTER, NONE), // enter
+    /* 142 */ KEY_ENTRY(HID_KEYBOARD_SC_MINUS_AND_UNDERSCORE, NONE), // minus
+    /* 143 */ KEY_ENTRY(HID_KEYBOARD_SC_DELETE, NONE), // bell off, *delete
+    /* 144 */ KEY_ENTRY(HID_KEYBOARD_SC_EQUAL_AND_PLUS, NONE), // equal dash
+    /* 145 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_6_AND_RIGHT_ARROW, NONE), // right arrow
+    /* 146 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NONE), // up arrow
+    /* 147 */ KEY_ENTRY(HID_KEYBOARD_SC_DOWN_ARROW, NONE), // down arrow
+    /* 150 */ KEY_ENTRY(HID_KEYBOARD_SC_S, NONE),
+    /* 151 */ KEY_ENTRY(HID_KEYBOARD_SC_T, NONE),
+    /* 152 */ KEY_ENTRY(HID_KEYBOARD_SC_U, NONE),
+    /* 153 */ KEY_ENTRY(HID_KEYBOARD_SC_V, NONE),
+    /* 154 */ KEY_ENTRY(HID_KEYBOARD_SC_RIGHT_ARROW, NONE), // edit right
+    /* 155 */ KEY_ENTRY(HID_KEYBOARD_SC_H, NONE), // H
+    /* 156 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NONE), // up arrow
+    /* 157 */ KEY_ENTRY(HID_KEYBOARD_SC_O, NONE),
+    /* 160 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_DOT_AND_DELETE, NONE), // period
+    /* 161 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_3_AND_PAGE_DOWN, NONE), // num 3
+    /* 162 */ KEY_ENTRY(HID_KEYBOARD_SC_6_AND_CARET, NONE),
+    /* 163 */ KEY_ENTRY(HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NONE), // num 8
+    /* 164 */ KEY_ENTRY(HID_KEYBOARD_SC_Z, NONE), // Z
+    /* 165 */ KEY_ENTRY(HID_KEYBOARD_SC_S, NONE), // S
+    /* 166 */ KEY_ENTRY(HID_KEYBOARD_SC_W, NONE), // W
+    /* 167 */ KEY_ENTRY(HID_KEYBOARD_SC_2_AND_AT, NONE), // 2
+    /* 170 */ KEY_ENTRY(HID_KEYBOARD_SC_F16, NONE), // F1
+    /* 171 */ KEY_ENTRY(HID_KEYBOARD_SC_F20, NONE), // F2
+    /* 172 */ KEY_ENTRY(HID_KEYBOARD_SC_F18, NONE), // F3
+    /* 173 */ KEY_ENTRY(HID_KEYBOARD_SC_STOP, NONE), // F4
+    /* 174 */ KEY_ENTRY(HID_KEYBOARD_SC_F5, NONE), // last page
+    /* 175 */ KEY_ENTRY(HID_KEYBOARD_SC_ESCAPE, NONE), // end
+    /* 176 */ KEY_ENTRY(0 /* check */, MACRO), // macrocheck
+    /* 177 */ KEY_ENTRY(0, NONE),
+  },
+};
+
+static const uint8_t ChordMask[128] PROGMEM = {
+  /* 000 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x02, 0x00,
+  /* 010 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00,
+  /* 020 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 030 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 040 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 050 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 060 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 070 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 100 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 110 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 120 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 130 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 140 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 150 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 160 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 170 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const uint8_t ChordsBySize[5] PROGMEM = { 0x00, 0x00, 0x03, 0x00, 0x00, };
+
+static const KeyEntry ChordEntries[KEY_CHORDS] PROGMEM = {
+  /* 015 016 */ KEY_ENTRY(HID_KEYBOARD_SC_ESCAPE, NONE),
+  /* 005 006 */ KEY_ENTRY(HID_KEYBOARD_SC_TAB, L_SHIFT),
+};
+
+static const uint8_t MacroSteps[] PROGMEM = {
+  /* 0: check */
+    MACRO_KEY(HID_KEYBOARD_SC_A),                                // 'a'
+    MACRO_KEY(HID_KEYBOARD_SC_B),                                // 'b'
+    MACRO_KEY(HID_KEYBOARD_SC_C),                                // 'c'
+    MACRO_KEY(HID_KEYBOARD_SC_D),                                // 'd'
+    MACRO_KEY(HID_KEYBOARD_SC_E),                                // 'e'
+    MACRO_KEY(HID_KEYBOARD_SC_F),                                // 'f'
+    MACRO_KEY(HID_KEYBOARD_SC_G),                                // 'g'
+    MACRO_KEY(HID_KEYBOARD_SC_H),                                // 'h'
+    MACRO_KEY(HID_KEYBOARD_SC_SPACE),                            // ' '
+    MACRO_SHIFTED(HID_KEYBOARD_SC_H),                            // 'H'
+    MACRO_KEY(HID_KEYBOARD_SC_E),                                // 'e'
+    MACRO_KEY(HID_KEYBOARD_SC_L),                                // 'l'
+    MACRO_KEY(HID_KEYBOARD_SC_L),                                // 'l'
+    MACRO_KEY(HID_KEYBOARD_SC_O),                                // 'o'
+    MACRO_KEY(HID_KEYBOARD_SC_COMMA_AND_LESS_THAN_SIGN),         // ','
+    MACRO_KEY(HID_KEYBOARD_SC_SPACE),                            // ' '
+    MACRO_SHIFTED(HID_KEYBOARD_SC_W),                            // 'W'
+    MACRO_KEY(HID_KEYBOARD_SC_O),                                // 'o'
+    MACRO_KEY(HID_KEYBOARD_SC_R),                                // 'r'
+    MACRO_KEY(HID_KEYBOARD_SC_L),                                // 'l'
+    MACRO_KEY(HID_KEYBOARD_SC_D),                                // 'd'
+    MACRO_SHIFTED(HID_KEYBOARD_SC_1_AND_EXCLAMATION),            // '!'
+    MACRO_KEY(HID_KEYBOARD_SC_ENTER),                            // \n
+    MACRO_MODS, 0x05, MACRO_KEY(HID_KEYBOARD_SC_DELETE),         // {L_CONTROL+L_ALT+DELETE}
+    MACRO_WAIT, 5,                                               // {wait 5}
+    MACRO_KEY(HID_KEYBOARD_SC_Z),                                // 'z'
+    MACRO_KEY(HID_KEYBOARD_SC_Z),                                // 'z'
+    MACRO_MODS, 0x0F, MACRO_KEY(HID_KEYBOARD_SC_F1),             // {L_CONTROL+L_ALT+L_SHIFT+L_GUI+F1}
+    MACRO_END,
+};
+
+static const uint16_t MacroStart[KEY_MACROS] PROGMEM = { 0, };
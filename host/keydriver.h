@@ -0,0 +1,384 @@
+/* ========================================================================
+   $File: keydriver $
+   $Notice: Host stand-in for the LUFA and AVR headers; -DHOST_BUILD only. $
+   ======================================================================== */
+
+/*
+  The host build (-DHOST_BUILD) compiles micro_boardfinal.c on its own,
+  with this directory ahead of the firmware's keydriver.h:
+
+    cc -O2 -DHOST_BUILD -Ihost -o bench micro_boardfinal.c
+
+  It supplies the LUFA types, constants and report item macros the scan
+  and report core uses, and stubs for the USB, clock and register
+  accesses left in the file, so the one translation unit links as is.
+  Registers are plain variables, and the USB calls do nothing.
+*/
+
+#ifndef KEYDRIVER_H
+#define KEYDRIVER_H
+
+// The bench clock is POSIX clock_gettime(), which plain -std=c99 hides;
+// this has to come before the first system header.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef HOST_BUILD
+#error "host/keydriver.h is for the host build only"
+#endif
+
+// avr-libc and LUFA attributes and helpers.
+#define F_CPU 16000000UL
+#define PROGMEM
+#define EEMEM
+#define ATTR_PACKED __attribute__((packed))
+#define ISR(vector) void vector(void)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+#define ARCH_AVR8 0
+#define ARCH_XMEGA 1
+#define ARCH ARCH_AVR8
+
+static inline void _delay_us(double us) { (void)us; }
+static inline void wdt_disable(void) {}
+#define clock_div_1 0
+static inline void clock_prescale_set(int div) { (void)div; }
+static inline void GlobalInterruptEnable(void) {}
+static inline void GlobalInterruptDisable(void) {}
+static inline uint8_t GetGlobalInterruptMask(void) { return 0; }
+static inline void SetGlobalInterruptMask(uint8_t mask) { (void)mask; }
+
+// Registers the file touches outside the HAL.
+static volatile uint8_t MCUSR, TCCR0A, TCCR0B, OCR0A, TIMSK0, TCNT0, TIFR0;
+#define WDRF 3
+#define WGM01 1
+#define CS00 0
+#define CS01 1
+#define OCIE0A 1
+#define OCF0A 1
+#define TIMER0_COMPA_vect Host_Timer0Compare
+
+// Descriptors.h: interface numbers and endpoints.
+enum { INTERFACE_ID_Keyboard = 0, INTERFACE_ID_RawHID = 1 };
+#define KEYBOARD_EPADDR 0x81
+#define KEYBOARD_EPSIZE 32
+#define RAWHID_EPADDR 0x82
+#define RAWHID_EPSIZE 64
+
+// LUFA USB device state and calls; nothing is attached.
+enum { DEVICE_STATE_Unattached, DEVICE_STATE_Powered, DEVICE_STATE_Default,
+       DEVICE_STATE_Addressed, DEVICE_STATE_Configured, DEVICE_STATE_Suspended };
+#define USB_Device_RemoteWakeupEnabled false
+static inline void USB_Init(void) {}
+static inline void USB_USBTask(void) {}
+static inline void USB_Device_EnableSOFEvents(void) {}
+static inline void USB_Device_SendRemoteWakeup(void) {}
+
+// LUFA's device events, which the firmware defines.
+void EVENT_USB_Device_ConfigurationChanged(void);
+void EVENT_USB_Device_ControlRequest(void);
+void EVENT_USB_Device_StartOfFrame(void);
+void EVENT_USB_Device_Suspend(void);
+void EVENT_USB_Device_WakeUp(void);
+
+// The setup packet of the control request being handled.
+typedef struct
+{
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} ATTR_PACKED USB_Request_Header_t;
+
+static USB_Request_Header_t USB_ControlRequest;
+
+// LUFA HID class driver.
+enum { HID_REPORT_ITEM_In = 0, HID_REPORT_ITEM_Out = 1, HID_REPORT_ITEM_Feature = 2 };
+enum { HID_REQ_GetReport = 0x01, HID_REQ_GetIdle = 0x02, HID_REQ_GetProtocol = 0x03,
+       HID_REQ_SetReport = 0x09, HID_REQ_SetIdle = 0x0A, HID_REQ_SetProtocol = 0x0B };
+
+typedef struct
+{
+  uint8_t Address;
+  uint16_t Size;
+  uint8_t Type;
+  uint8_t Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct
+{
+  struct
+  {
+    uint8_t InterfaceNumber;
+    USB_Endpoint_Table_t ReportINEndpoint;
+    void* PrevReportINBuffer;
+    uint8_t PrevReportINBufferSize;
+  } Config;
+  struct
+  {
+    bool UsingReportProtocol;
+    uint16_t PrevFrameNum;
+    uint16_t IdleCount;
+    uint16_t IdleMSRemaining;
+  } State;
+} USB_ClassInfo_HID_Device_t;
+
+typedef struct
+{
+  uint8_t Modifier;
+  uint8_t Reserved;
+  uint8_t KeyCode[6];
+} ATTR_PACKED USB_KeyboardReport_Data_t;
+
+static inline bool HID_Device_ConfigureEndpoints(USB_ClassInfo_HID_Device_t* info) { (void)info; return true; }
+static inline void HID_Device_ProcessControlRequest(USB_ClassInfo_HID_Device_t* info) { (void)info; }
+static inline void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t* info) { (void)info; }
+static inline void HID_Device_USBTask(USB_ClassInfo_HID_Device_t* info) { (void)info; }
+
+#define HID_KEYBOARD_MODIFIER_LEFTCTRL   (1 << 0)
+#define HID_KEYBOARD_MODIFIER_LEFTSHIFT  (1 << 1)
+#define HID_KEYBOARD_MODIFIER_LEFTALT    (1 << 2)
+#define HID_KEYBOARD_MODIFIER_LEFTGUI    (1 << 3)
+#define HID_KEYBOARD_MODIFIER_RIGHTCTRL  (1 << 4)
+#define HID_KEYBOARD_MODIFIER_RIGHTSHIFT (1 << 5)
+#define HID_KEYBOARD_MODIFIER_RIGHTALT   (1 << 6)
+#define HID_KEYBOARD_MODIFIER_RIGHTGUI   (1 << 7)
+
+#define HID_KEYBOARD_LED_NUMLOCK    (1 << 0)
+#define HID_KEYBOARD_LED_CAPSLOCK   (1 << 1)
+#define HID_KEYBOARD_LED_SCROLLLOCK (1 << 2)
+#define HID_KEYBOARD_LED_COMPOSE    (1 << 3)
+#define HID_KEYBOARD_LED_KANA       (1 << 4)
+
+// Report descriptor items, encoded as LUFA encodes them.
+typedef uint8_t USB_Descriptor_HIDReport_Datatype_t;
+
+#define HID_RI_BYTES_0(d)
+#define HID_RI_BYTES_8(d)  , ((d) & 0xFF)
+#define HID_RI_BYTES_16(d) , ((d) & 0xFF), (((d) >> 8) & 0xFF)
+#define HID_RI_BYTES_32(d) , ((d) & 0xFF), (((d) >> 8) & 0xFF), \
+                           (((d) >> 16) & 0xFF), (((d) >> 24) & 0xFF)
+#define HID_RI_SIZE_0  0x00
+#define HID_RI_SIZE_8  0x01
+#define HID_RI_SIZE_16 0x02
+#define HID_RI_SIZE_32 0x03
+#define HID_RI_DATA(tag, bits, d) ((tag) | HID_RI_SIZE_##bits) HID_RI_BYTES_##bits(d)
+
+#define HID_RI_INPUT(bits, d)            HID_RI_DATA(0x80, bits, d)
+#define HID_RI_OUTPUT(bits, d)           HID_RI_DATA(0x90, bits, d)
+#define HID_RI_COLLECTION(bits, d)       HID_RI_DATA(0xA0, bits, d)
+#define HID_RI_FEATURE(bits, d)          HID_RI_DATA(0xB0, bits, d)
+#define HID_RI_END_COLLECTION(bits)      HID_RI_DATA(0xC0, bits, 0)
+#define HID_RI_USAGE_PAGE(bits, d)       HID_RI_DATA(0x04, bits, d)
+#define HID_RI_LOGICAL_MINIMUM(bits, d)  HID_RI_DATA(0x14, bits, d)
+#define HID_RI_LOGICAL_MAXIMUM(bits, d)  HID_RI_DATA(0x24, bits, d)
+#define HID_RI_REPORT_SIZE(bits, d)      HID_RI_DATA(0x74, bits, d)
+#define HID_RI_REPORT_ID(bits, d)        HID_RI_DATA(0x84, bits, d)
+#define HID_RI_REPORT_COUNT(bits, d)     HID_RI_DATA(0x94, bits, d)
+#define HID_RI_USAGE(bits, d)            HID_RI_DATA(0x08, bits, d)
+#define HID_RI_USAGE_MINIMUM(bits, d)    HID_RI_DATA(0x18, bits, d)
+#define HID_RI_USAGE_MAXIMUM(bits, d)    HID_RI_DATA(0x28, bits, d)
+
+#define HID_IOF_DATA     (0 << 0)
+#define HID_IOF_CONSTANT (1 << 0)
+#define HID_IOF_ARRAY    (0 << 1)
+#define HID_IOF_VARIABLE (1 << 1)
+#define HID_IOF_ABSOLUTE (0 << 2)
+
+#define HID_DESCRIPTOR_VENDOR(page, collection, in, out, bytes)         \
+  HID_RI_USAGE_PAGE(16, (0xFF00 | (page))),                             \
+  HID_RI_USAGE(8, collection),                                          \
+  HID_RI_COLLECTION(8, 0x01),                                           \
+    HID_RI_USAGE(8, in),                                                \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(8, 0xFF),                                    \
+    HID_RI_REPORT_SIZE(8, 0x08),                                        \
+    HID_RI_REPORT_COUNT(16, bytes),                                     \
+    HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+    HID_RI_USAGE(8, out),                                               \
+    HID_RI_LOGICAL_MINIMUM(8, 0x00),                                    \
+    HID_RI_LOGICAL_MAXIMUM(8, 0xFF),                                    \
+    HID_RI_REPORT_SIZE(8, 0x08),                                        \
+    HID_RI_REPORT_COUNT(16, bytes),                                     \
+    HID_RI_OUTPUT(16, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),\
+  HID_RI_END_COLLECTION(0)
+
+// Keyboard / Keypad page usages, with LUFA's names, through the locking
+// keys and the rest of USAGE_LIMIT, plus the modifiers.
+#define HID_KEYBOARD_SC_ERROR_ROLLOVER                    0x01
+#define HID_KEYBOARD_SC_POST_FAIL                         0x02
+#define HID_KEYBOARD_SC_ERROR_UNDEFINED                   0x03
+#define HID_KEYBOARD_SC_A                                 0x04
+#define HID_KEYBOARD_SC_B                                 0x05
+#define HID_KEYBOARD_SC_C                                 0x06
+#define HID_KEYBOARD_SC_D                                 0x07
+#define HID_KEYBOARD_SC_E                                 0x08
+#define HID_KEYBOARD_SC_F                                 0x09
+#define HID_KEYBOARD_SC_G                                 0x0A
+#define HID_KEYBOARD_SC_H                                 0x0B
+#define HID_KEYBOARD_SC_I                                 0x0C
+#define HID_KEYBOARD_SC_J                                 0x0D
+#define HID_KEYBOARD_SC_K                                 0x0E
+#define HID_KEYBOARD_SC_L                                 0x0F
+#define HID_KEYBOARD_SC_M                                 0x10
+#define HID_KEYBOARD_SC_N                                 0x11
+#define HID_KEYBOARD_SC_O                                 0x12
+#define HID_KEYBOARD_SC_P                                 0x13
+#define HID_KEYBOARD_SC_Q                                 0x14
+#define HID_KEYBOARD_SC_R                                 0x15
+#define HID_KEYBOARD_SC_S                                 0x16
+#define HID_KEYBOARD_SC_T                                 0x17
+#define HID_KEYBOARD_SC_U                                 0x18
+#define HID_KEYBOARD_SC_V                                 0x19
+#define HID_KEYBOARD_SC_W                                 0x1A
+#define HID_KEYBOARD_SC_X                                 0x1B
+#define HID_KEYBOARD_SC_Y                                 0x1C
+#define HID_KEYBOARD_SC_Z                                 0x1D
+#define HID_KEYBOARD_SC_1_AND_EXCLAMATION                 0x1E
+#define HID_KEYBOARD_SC_2_AND_AT                          0x1F
+#define HID_KEYBOARD_SC_3_AND_HASHMARK                    0x20
+#define HID_KEYBOARD_SC_4_AND_DOLLAR                      0x21
+#define HID_KEYBOARD_SC_5_AND_PERCENTAGE                  0x22
+#define HID_KEYBOARD_SC_6_AND_CARET                       0x23
+#define HID_KEYBOARD_SC_7_AND_AMPERSAND                   0x24
+#define HID_KEYBOARD_SC_8_AND_ASTERISK                    0x25
+#define HID_KEYBOARD_SC_9_AND_OPENING_PARENTHESIS         0x26
+#define HID_KEYBOARD_SC_0_AND_CLOSING_PARENTHESIS         0x27
+#define HID_KEYBOARD_SC_ENTER                             0x28
+#define HID_KEYBOARD_SC_ESCAPE                            0x29
+#define HID_KEYBOARD_SC_BACKSPACE                         0x2A
+#define HID_KEYBOARD_SC_TAB                               0x2B
+#define HID_KEYBOARD_SC_SPACE                             0x2C
+#define HID_KEYBOARD_SC_MINUS_AND_UNDERSCORE              0x2D
+#define HID_KEYBOARD_SC_EQUAL_AND_PLUS                    0x2E
+#define HID_KEYBOARD_SC_OPENING_BRACKET_AND_OPENING_BRACE 0x2F
+#define HID_KEYBOARD_SC_CLOSING_BRACKET_AND_CLOSING_BRACE 0x30
+#define HID_KEYBOARD_SC_BACKSLASH_AND_PIPE                0x31
+#define HID_KEYBOARD_SC_NON_US_HASHMARK_AND_TILDE         0x32
+#define HID_KEYBOARD_SC_SEMICOLON_AND_COLON               0x33
+#define HID_KEYBOARD_SC_APOSTROPHE_AND_QUOTE              0x34
+#define HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE            0x35
+#define HID_KEYBOARD_SC_COMMA_AND_LESS_THAN_SIGN          0x36
+#define HID_KEYBOARD_SC_DOT_AND_GREATER_THAN_SIGN         0x37
+#define HID_KEYBOARD_SC_SLASH_AND_QUESTION_MARK           0x38
+#define HID_KEYBOARD_SC_CAPS_LOCK                         0x39
+#define HID_KEYBOARD_SC_F1                                0x3A
+#define HID_KEYBOARD_SC_F2                                0x3B
+#define HID_KEYBOARD_SC_F3                                0x3C
+#define HID_KEYBOARD_SC_F4                                0x3D
+#define HID_KEYBOARD_SC_F5                                0x3E
+#define HID_KEYBOARD_SC_F6                                0x3F
+#define HID_KEYBOARD_SC_F7                                0x40
+#define HID_KEYBOARD_SC_F8                                0x41
+#define HID_KEYBOARD_SC_F9                                0x42
+#define HID_KEYBOARD_SC_F10                               0x43
+#define HID_KEYBOARD_SC_F11                               0x44
+#define HID_KEYBOARD_SC_F12                               0x45
+#define HID_KEYBOARD_SC_PRINT_SCREEN                      0x46
+#define HID_KEYBOARD_SC_SCROLL_LOCK                       0x47
+#define HID_KEYBOARD_SC_PAUSE                             0x48
+#define HID_KEYBOARD_SC_INSERT                            0x49
+#define HID_KEYBOARD_SC_HOME                              0x4A
+#define HID_KEYBOARD_SC_PAGE_UP                           0x4B
+#define HID_KEYBOARD_SC_DELETE                            0x4C
+#define HID_KEYBOARD_SC_END                               0x4D
+#define HID_KEYBOARD_SC_PAGE_DOWN                         0x4E
+#define HID_KEYBOARD_SC_RIGHT_ARROW                       0x4F
+#define HID_KEYBOARD_SC_LEFT_ARROW                        0x50
+#define HID_KEYBOARD_SC_DOWN_ARROW                        0x51
+#define HID_KEYBOARD_SC_UP_ARROW                          0x52
+#define HID_KEYBOARD_SC_NUM_LOCK                          0x53
+#define HID_KEYBOARD_SC_KEYPAD_SLASH                      0x54
+#define HID_KEYBOARD_SC_KEYPAD_ASTERISK                   0x55
+#define HID_KEYBOARD_SC_KEYPAD_MINUS                      0x56
+#define HID_KEYBOARD_SC_KEYPAD_PLUS                       0x57
+#define HID_KEYBOARD_SC_KEYPAD_ENTER                      0x58
+#define HID_KEYBOARD_SC_KEYPAD_1_AND_END                  0x59
+#define HID_KEYBOARD_SC_KEYPAD_2_AND_DOWN_ARROW           0x5A
+#define HID_KEYBOARD_SC_KEYPAD_3_AND_PAGE_DOWN            0x5B
+#define HID_KEYBOARD_SC_KEYPAD_4_AND_LEFT_ARROW           0x5C
+#define HID_KEYBOARD_SC_KEYPAD_5                          0x5D
+#define HID_KEYBOARD_SC_KEYPAD_6_AND_RIGHT_ARROW          0x5E
+#define HID_KEYBOARD_SC_KEYPAD_7_AND_HOME                 0x5F
+#define HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW             0x60
+#define HID_KEYBOARD_SC_KEYPAD_9_AND_PAGE_UP              0x61
+#define HID_KEYBOARD_SC_KEYPAD_0_AND_INSERT               0x62
+#define HID_KEYBOARD_SC_KEYPAD_DOT_AND_DELETE             0x63
+#define HID_KEYBOARD_SC_NON_US_BACKSLASH_AND_PIPE         0x64
+#define HID_KEYBOARD_SC_APPLICATION                       0x65
+#define HID_KEYBOARD_SC_POWER                             0x66
+#define HID_KEYBOARD_SC_KEYPAD_EQUAL_SIGN                 0x67
+#define HID_KEYBOARD_SC_F13                               0x68
+#define HID_KEYBOARD_SC_F14                               0x69
+#define HID_KEYBOARD_SC_F15                               0x6A
+#define HID_KEYBOARD_SC_F16                               0x6B
+#define HID_KEYBOARD_SC_F17                               0x6C
+#define HID_KEYBOARD_SC_F18                               0x6D
+#define HID_KEYBOARD_SC_F19                               0x6E
+#define HID_KEYBOARD_SC_F20                               0x6F
+#define HID_KEYBOARD_SC_F21                               0x70
+#define HID_KEYBOARD_SC_F22                               0x71
+#define HID_KEYBOARD_SC_F23                               0x72
+#define HID_KEYBOARD_SC_F24                               0x73
+#define HID_KEYBOARD_SC_EXECUTE                           0x74
+#define HID_KEYBOARD_SC_HELP                              0x75
+#define HID_KEYBOARD_SC_MENU                              0x76
+#define HID_KEYBOARD_SC_SELECT                            0x77
+#define HID_KEYBOARD_SC_STOP                              0x78
+#define HID_KEYBOARD_SC_AGAIN                             0x79
+#define HID_KEYBOARD_SC_UNDO                              0x7A
+#define HID_KEYBOARD_SC_CUT                               0x7B
+#define HID_KEYBOARD_SC_COPY                              0x7C
+#define HID_KEYBOARD_SC_PASTE                             0x7D
+#define HID_KEYBOARD_SC_FIND                              0x7E
+#define HID_KEYBOARD_SC_MUTE                              0x7F
+#define HID_KEYBOARD_SC_VOLUME_UP                         0x80
+#define HID_KEYBOARD_SC_VOLUME_DOWN                       0x81
+#define HID_KEYBOARD_SC_LOCKING_CAPS_LOCK                 0x82
+#define HID_KEYBOARD_SC_LOCKING_NUM_LOCK                  0x83
+#define HID_KEYBOARD_SC_LOCKING_SCROLL_LOCK               0x84
+#define HID_KEYBOARD_SC_KEYPAD_COMMA                      0x85
+#define HID_KEYBOARD_SC_KEYPAD_EQUAL_SIGN_AS400           0x86
+#define HID_KEYBOARD_SC_INTERNATIONAL1                    0x87
+#define HID_KEYBOARD_SC_INTERNATIONAL2                    0x88
+#define HID_KEYBOARD_SC_INTERNATIONAL3                    0x89
+#define HID_KEYBOARD_SC_INTERNATIONAL4                    0x8A
+#define HID_KEYBOARD_SC_INTERNATIONAL5                    0x8B
+#define HID_KEYBOARD_SC_INTERNATIONAL6                    0x8C
+#define HID_KEYBOARD_SC_INTERNATIONAL7                    0x8D
+#define HID_KEYBOARD_SC_INTERNATIONAL8                    0x8E
+#define HID_KEYBOARD_SC_INTERNATIONAL9                    0x8F
+#define HID_KEYBOARD_SC_LANG1                             0x90
+#define HID_KEYBOARD_SC_LANG2                             0x91
+#define HID_KEYBOARD_SC_LANG3                             0x92
+#define HID_KEYBOARD_SC_LANG4                             0x93
+#define HID_KEYBOARD_SC_LANG5                             0x94
+#define HID_KEYBOARD_SC_LANG6                             0x95
+#define HID_KEYBOARD_SC_LANG7                             0x96
+#define HID_KEYBOARD_SC_LANG8                             0x97
+#define HID_KEYBOARD_SC_LANG9                             0x98
+#define HID_KEYBOARD_SC_ALTERNATE_ERASE                   0x99
+#define HID_KEYBOARD_SC_SYSREQ                            0x9A
+#define HID_KEYBOARD_SC_CANCEL                            0x9B
+#define HID_KEYBOARD_SC_CLEAR                             0x9C
+#define HID_KEYBOARD_SC_PRIOR                             0x9D
+#define HID_KEYBOARD_SC_RETURN                            0x9E
+#define HID_KEYBOARD_SC_SEPARATOR                         0x9F
+#define HID_KEYBOARD_SC_LEFT_CONTROL                      0xE0
+#define HID_KEYBOARD_SC_LEFT_SHIFT                        0xE1
+#define HID_KEYBOARD_SC_LEFT_ALT                          0xE2
+#define HID_KEYBOARD_SC_LEFT_GUI                          0xE3
+#define HID_KEYBOARD_SC_RIGHT_CONTROL                     0xE4
+#define HID_KEYBOARD_SC_RIGHT_SHIFT                       0xE5
+#define HID_KEYBOARD_SC_RIGHT_ALT                         0xE6
+#define HID_KEYBOARD_SC_RIGHT_GUI                         0xE7
+
+#endif
@@ -32,8 +32,37 @@
 
 
 #include "keydriver.h"
+#if (defined(SETTLE_CALIBRATE) || defined(KEYMAP_EEPROM)) && !defined(HOST_BUILD)
+#include <avr/eeprom.h>
+#endif
+#if defined(IDLE_GOVERNOR) && !defined(HOST_BUILD)
+#include <avr/sleep.h>
+#endif
+
+// Report layouts and descriptors; see hidreports.h.
+#include "hidreports.h"
+
+#if KEYBOARD_EPSIZE != 8 && KEYBOARD_EPSIZE != 16 && KEYBOARD_EPSIZE != 32 && \
+    KEYBOARD_EPSIZE != 64
+#error "KEYBOARD_EPSIZE must be 8, 16, 32 or 64 for a full-speed interrupt endpoint"
+#endif
+#if KEYBOARD_EPSIZE < 1 + 8
+#error "KEYBOARD_EPSIZE must hold the boot report and its report ID"
+#endif
+#if defined(NKRO_REPORT) && KEYBOARD_EPSIZE < 1 + NKRO_REPORT_SIZE
+#error "KEYBOARD_EPSIZE must hold the NKRO report and its report ID"
+#endif
 
-static USB_KeyboardReport_Data_t PrevKeyboardReport;
+// LUFA sizes its IN and GET_REPORT buffers from PrevReportINBufferSize, so
+// this has to hold the largest report of any kind.
+typedef union
+{
+  USB_KeyboardReport_Data_t Boot;
+#ifdef NKRO_REPORT
+  USB_KeyboardNKROReport_Data_t NKRO;
+#endif
+  TelemetryReport_t Telemetry;
+} KeyboardReportBuffer_t;
 
 
 USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
@@ -45,17 +74,49 @@ USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
     {
       .Address              = KEYBOARD_EPADDR,
       .Size                 = KEYBOARD_EPSIZE,
+#ifdef REPORT_QUEUE
+      .Banks                = 2,
+#else
+      .Banks                = 1,
+#endif
+    },
+    // No previous-report buffer: CALLBACK_HID_Device_CreateHIDReport
+    // tracks changes itself and forces a send, so LUFA skips the memcmp.
+    .PrevReportINBuffer     = NULL,
+    .PrevReportINBufferSize = sizeof(KeyboardReportBuffer_t),
+  },
+};
+
+// Raw event stream (-DRAW_EVENTS): a second, vendor-defined HID interface
+// (INTERFACE_ID_RawHID, IN endpoint RAWHID_EPADDR) carrying every
+// debounced press and release by matrix position, in scan order, with a
+// microsecond timestamp, in RawEventsReport_t. Timestamps come from
+// HAL_Ticks and wrap after about 71 minutes; they stop while the MCU is
+// powered down in suspend. tools/rawevents.c reads the stream on the host.
+#ifdef RAW_EVENTS
+USB_ClassInfo_HID_Device_t RawEvents_HID_Interface =
+{
+  .Config =
+  {
+    .InterfaceNumber        = INTERFACE_ID_RawHID,
+    .ReportINEndpoint       =
+    {
+      .Address              = RAWHID_EPADDR,
+      .Size                 = RAWHID_EPSIZE,
       .Banks                = 1,
     },
-    .PrevReportINBuffer     = &PrevKeyboardReport,
-    .PrevReportINBufferSize = sizeof(PrevKeyboardReport),
+    .PrevReportINBuffer     = NULL,
+    .PrevReportINBufferSize = sizeof(RawEventsReport_t),
   },
 };
+#endif
 
 typedef enum {
   NONE = 0,
   L_SHIFT = 1, R_SHIFT, L_CONTROL, R_CONTROL, L_META, R_META, L_SUPER, R_SUPER,
-  CAPS_LOCK, ALT_LOCK, REPEAT
+  CAPS_LOCK, ALT_LOCK, REPEAT,
+  LAYER_1, LAYER_2, LAYER_3,    // Held: new presses use that layer.
+  MACRO                         // Plays the macro the usage byte numbers.
 } KeyShift;
 
 
@@ -71,23 +132,33 @@ typedef enum {
 
 typedef uint8_t HidUsageID;
 
-// Information about each key.
-typedef struct
-{
-  HidUsageID hidUsageID;        // Currently always from the Keyboard / Keypad page.
-  KeyShift shift;
-  PGM_P keysym;
-// Or NULL if an ordinary PC/AT-101 key with no symbol.
-} KeyInfo;
-
-// As much as possible, keysyms are taken from <gdk/gdkkeysyms.h>,
-// which seems to be the most comprehensive list of X keysyms.
-#define KEYSYM(name,keysym) static const char name[] PROGMEM = keysym
-#define NO_KEY(idx) {0,NONE,NULL}
-#define SHIFT_KEY(idx,hid,shift) { hid, shift, NULL}
-
-#define PC_KEY(idx,hid,keysym) {hid,NONE,keysym}
-
+// Information about each key, packed so one pgm_read_word fetches it:
+// usage (currently always from the Keyboard / Keypad page) in the low
+// byte, KeyShift in the high byte. The table itself, Keys[KEY_LAYERS][128],
+// is generated from keymap.txt and any layer files by tools/keymapgen into
+// keymap.h, with every layer fully resolved.
+typedef uint16_t KeyEntry;
+
+#define KEY_ENTRY(hid,shift) ((KeyEntry)(((uint16_t)(shift) << 8) | (hid)))
+#define KEY_USAGE(k) ((HidUsageID)((k) & 0xFF))
+#define KEY_SHIFT(k) ((KeyShift)(((k) >> 8) & 0x7F))
+#define KEY_AUTO_REPEAT 0x80    // Or'ed into the shift for "repeat" entries.
+#define KEY_REPEATS(k) ((k) & (KEY_AUTO_REPEAT << 8))
+
+// Macro steps, as tools/keymapgen writes them into MacroSteps[]: a key
+// tap is one byte, the usage with bit 7 for left shift; 0..3 start the
+// other steps. Tapped usages are checked at compile time.
+#define MACRO_END           0x00
+#define MACRO_MODS          0x01        // Modifier byte, then the key it holds.
+#define MACRO_WAIT          0x02        // Milliseconds, 1..255.
+#define MACRO_MODS_TAP      0x03        // Modifier byte, tapped alone.
+#define MACRO_SHIFT_BIT     0x80
+#define MACRO_KEY(u) \
+  ((uint8_t)((u) + 0 * sizeof(char[(u) >= 0x04 && (u) < MACRO_SHIFT_BIT ? 1 : -1])))
+#define MACRO_SHIFTED(u)    (MACRO_KEY(u) | MACRO_SHIFT_BIT)
+
+// The translation mode picks the base layer: HUT1 is layer 0 and HUT1 + n
+// is layer n. Modes with no such layer use layer 0.
 typedef enum {
   HUT1 = 1
 } TranslationMode;
@@ -95,389 +166,3251 @@ typedef enum {
 
 static TranslationMode CurrentModes[1];
 
+// Selected through the third byte of the Feature report. The boot format
+// is always used while the host has the interface in boot protocol.
+typedef enum {
+  REPORT_6KRO = 0,
+  REPORT_NKRO = 1
+} ReportFormat;
+
+static ReportFormat CurrentFormat;
+
 
 static uint32_t CurrentShifts;
-static HidUsageID KeysDown[16];
-static uint8_t NKeysDown;
+
+// Pressed-key set. PhysKeysDown has one bit per matrix position so repeated
+// or spurious events for the same key are ignored. UsageRefs counts how many
+// held keys produce each usage (several positions share one), and UsageDown
+// has a bit set for every usage with a non-zero count. Press and release are
+// constant time; reports are built from UsageDown in one pass.
+#define USAGE_LIMIT KEYBOARD_USAGES      // Through the locking keys.
+#define USAGE_BYTES (USAGE_LIMIT / 8)
+
+static uint8_t PhysKeysDown[16];
+static uint8_t UsageDown[USAGE_BYTES];
+static uint8_t UsageRefs[USAGE_LIMIT];
+static uint8_t NKeysDown;       // Distinct usages down.
 static bool NeedEmptyReport;
 
+// Bumped on every change to the pressed-key set or shifts; the report
+// callback compares it with the generation it last sent. 16 bits, since
+// macro playback bumps it several times a report and 8 could come round.
+// Only the main loop touches either.
+static uint16_t KeyStateGeneration, ReportedGeneration;
+#ifdef NKRO_REPORT
+static bool ReportedNKRO;       // Format of the last report sent.
+#endif
+// Set while a GET_REPORT control request is handled: the report callback
+// then reads the current state and leaves the interrupt pipe's change
+// tracking, event queue and macro, chord and repeat steps alone.
+static bool ControlGetReport;
+
+
+// Matrix wiring; see boards/microswitch.h.
+#ifndef BOARD
+#define BOARD "boards/microswitch.h"
+#endif
+#include BOARD
+
+#if SC_COLUMNS < 1 || SC_COLUMNS > 16 || SC_COLUMNS - 1 > SC_ADDR_MASK
+#error "SC_COLUMNS must be 1..16 and fit the address bits"
+#endif
+
+// Whole-port values for the unrolled scan: column c addressed with the
+// decoder off, and with it on.
+#define SC_SELECT(c)        (SC_PORT_REST | SC_STROBE | ((c) << SC_ADDR_SHIFT))
+#define SC_STROBED(c)       (SC_PORT_REST | ((c) << SC_ADDR_SHIFT))
+
+// Hardware access for the matrix goes through these so the scan / report
+// core can also be built on a host (-DHOST_BUILD) against a simulated matrix.
+#ifndef HOST_BUILD
+// Timer1 free-runs at F_CPU/8 as the tick source for settle deadlines and
+// scan timing.
+#define HAL_TICK_NS         (8000UL / (F_CPU / 1000000UL))
+#define HAL_Init()                                      \
+  do {                                                  \
+    SC_ADDR_DDR |= (SC_ADDR_MASK << SC_ADDR_SHIFT);     \
+    SC_STROBE_DDR |= SC_STROBE;                         \
+    SC_STROBE_PORT |= SC_STROBE;  /* Idle high. */      \
+    TCCR1A = 0;                                         \
+    TCCR1B = (1 << CS11);                               \
+  } while (0)
+#define HAL_Ticks()         (TCNT1)
+#define SC_SETTLE_TICKS     ((SC_SETTLE_US * 1000UL + HAL_TICK_NS - 1) / HAL_TICK_NS)
+// Busy-wait until 'ticks' have elapsed since the strobe at 'since'.
+#define HAL_SettleSince(since,ticks) \
+  while ((uint16_t)(HAL_Ticks() - (since)) < (ticks))
+#define HAL_SelectColumn(c) \
+  (SC_ADDR_PORT = (SC_ADDR_PORT & ~(SC_ADDR_MASK << SC_ADDR_SHIFT)) | ((c) << SC_ADDR_SHIFT))
+#define HAL_StrobeLow()     (SC_STROBE_PORT &= ~SC_STROBE)
+#define HAL_StrobeHigh()    (SC_STROBE_PORT |= SC_STROBE)
+#define HAL_WritePort(v)    (SC_ADDR_PORT = (v))
+#define HAL_Settle()        _delay_us(SC_SETTLE_US)
+#define HAL_ReadKeys()      (SC_KEYS_PIN)
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Simulated matrix: one byte per column, active low like PIND, behind
+// the board's address and strobe port.
+static uint8_t SimMatrix[16];
+static uint8_t SimPort;
+
+static uint8_t SimReadKeys(void)
+{
+  if (SimPort & SC_STROBE)
+    return 0xFF;                // Decoder off; the rows float high.
+  return SimMatrix[(SimPort >> SC_ADDR_SHIFT) & SC_ADDR_MASK & 0x0F];
+}
+
+// Ticks of 0.5 us, as Timer1 at 16 MHz, so the 16-bit count wraps every
+// 32.8 ms on the host too and latency buckets mean the same.
+#define HAL_TICK_NS         500UL
+
+static uint16_t HostTicks(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint16_t)((ts.tv_sec * 1000000000LL + ts.tv_nsec) / HAL_TICK_NS);
+}
+
+#define HAL_Init()          (memset(SimMatrix, 0xFF, sizeof(SimMatrix)), SimPort = SC_SELECT(0))
+#define HAL_Ticks()         HostTicks()
+#define HAL_SelectColumn(c) \
+  (SimPort = (SimPort & ~(SC_ADDR_MASK << SC_ADDR_SHIFT)) | ((c) << SC_ADDR_SHIFT))
+#define HAL_StrobeLow()     (SimPort &= ~SC_STROBE)
+#define HAL_StrobeHigh()    (SimPort |= SC_STROBE)
+#define HAL_WritePort(v)    (SimPort = (v))
+#define HAL_Settle()        ((void)0)
+#define HAL_ReadKeys()      SimReadKeys()
+#define HAL_SettleSince(since,ticks) ((void)(since), (void)(ticks))
+#define SC_SETTLE_TICKS     0
+#endif
+
+// Per-column settle calibration (-DSETTLE_CALIBRATE). For each column, the
+// shortest strobe-to-read delay that returns the same value as a full
+// SETTLE_MAX_TICKS read over SETTLE_SAMPLES tries, right after reading the
+// previous column as the scan does, plus SETTLE_MARGIN_TICKS. Rows with no
+// key down read high whatever the delay, so a column only gets a shorter
+// delay from a run that saw one of its keys down; otherwise it keeps its
+// delay, SC_SETTLE_TICKS to begin with, or takes a longer one. The table
+// is kept in EEPROM with a magic byte and checksum; calibration runs at
+// boot when that is missing or corrupt, and on demand via a Feature
+// report, so holding keys in different columns over several runs
+// calibrates them all.
+#ifdef SETTLE_CALIBRATE
+#define SETTLE_MAX_TICKS    (2 * SC_SETTLE_TICKS)
+#ifndef SETTLE_SAMPLES
+#define SETTLE_SAMPLES      32
+#endif
+#ifndef SETTLE_MARGIN_TICKS
+#define SETTLE_MARGIN_TICKS 2
+#endif
+#define SETTLE_MAGIC        0x5C
+
+static SettleTable ColumnSettle;
+#ifndef HOST_BUILD
+static SettleTable EEMEM ColumnSettleEE;
+#endif
+static volatile bool SettleCalibrateRequested;
+
+#define COLUMN_SETTLE_TICKS(c) (ColumnSettle.ticks[c])
+#else
+#define COLUMN_SETTLE_TICKS(c) (SC_SETTLE_TICKS)
+#endif
+
+// Full-matrix scan time in HAL ticks.
+static uint16_t ScanTicksLast, ScanTicksMin = 0xFFFF, ScanTicksMax;
+
+// With -DSCAN_TIMER, Timer0 runs in CTC mode and its compare ISR calls
+// Direct_Scan at SCAN_RATE_HZ; the main loop only services USB. With
+// -DSCAN_SOF_LOCK as well, every SOF reloads TCNT0 so the scan fires
+// SCAN_SOF_LEAD_US before the next frame and its result is ready for the
+// following 1 ms IN poll. That point has to fall within one scan period
+// of the SOF, which in practice means SCAN_RATE_HZ 1000.
+#ifdef SCAN_TIMER
+#ifndef SCAN_RATE_HZ
+#define SCAN_RATE_HZ 1000
+#endif
+#ifndef SCAN_SOF_LEAD_US
+#define SCAN_SOF_LEAD_US 200
+#endif
+#define SCAN_TIMER_HZ    (F_CPU / 64)
+#define SCAN_TIMER_TOP   (SCAN_TIMER_HZ / SCAN_RATE_HZ - 1)
+#define SCAN_SOF_DELAY   (SCAN_TIMER_HZ * (1000UL - SCAN_SOF_LEAD_US) / 1000000UL)
+#if SCAN_TIMER_TOP > 255 || SCAN_TIMER_TOP < 1
+#error "SCAN_RATE_HZ out of range for Timer0 at F_CPU/64"
+#endif
+#if defined(SCAN_SOF_LOCK) && \
+    (SCAN_SOF_LEAD_US >= 1000 || SCAN_SOF_DELAY >= SCAN_TIMER_TOP + 1)
+#error "SCAN_SOF_LEAD_US must place the scan within one scan period of SOF"
+#endif
+
+static uint16_t ScanOverruns;   // Scans that ran past the next compare.
+#endif
+
+// Idle governor (-DIDLE_GOVERNOR). After IDLE_AFTER_MS without matrix
+// activity, scans run only every IDLE_SCAN_MS and the MCU sleeps in
+// between. The first raw change a scan sees restores full-rate scanning
+// before debounce has finished, so that press is debounced and queued as
+// usual; IDLE_SCAN_MS must stay below the shortest tap. While the bus is
+// suspended there are no SOFs and the USB clock is frozen, so the MCU
+// powers down and the watchdog interrupt wakes it about every 16 ms to
+// scan. Activity then requests remote wakeup, if the host has enabled it,
+// and scanning runs at full rate until the bus resumes. Remote wakeup also
+// needs USB_CONFIG_ATTR_REMOTEWAKEUP in the configuration descriptor.
+#ifdef IDLE_GOVERNOR
+#ifndef IDLE_AFTER_MS
+#define IDLE_AFTER_MS 5000
+#endif
+#ifndef IDLE_SCAN_MS
+#define IDLE_SCAN_MS 8
+#endif
+#if IDLE_AFTER_MS < 1 || IDLE_AFTER_MS > 60000 || IDLE_SCAN_MS < 1 || IDLE_SCAN_MS > 255
+#error "IDLE_AFTER_MS must be 1..60000 and IDLE_SCAN_MS 1..255"
+#endif
+#ifdef SCAN_TIMER
+// Scan timer periods per idle scan, counted by the ISR in a byte.
+#define IDLE_SCAN_PERIODS ((1UL * SCAN_RATE_HZ * IDLE_SCAN_MS + 999) / 1000)
+#if IDLE_SCAN_PERIODS > 255
+#error "IDLE_SCAN_MS must be at most 255 scan periods at SCAN_RATE_HZ"
+#endif
+#endif
+
+static uint16_t IdleMs;                 // SOFs since the last activity; SOF only.
+static volatile bool ScanActivity;      // Set by the scanner, taken by SOF.
+static volatile bool ScanIdle;          // Scanning at the idle rate.
+static volatile bool IdleScanDue;       // Set by SOF every IDLE_SCAN_MS when idle.
+static volatile bool UsbSuspended;
+#endif
+
+
+// A full matrix snapshot, one byte per column, also viewable as words so
+// whole snapshots can be compared a word at a time.
+#define MATRIX_WORDS (16 / sizeof(uint32_t))
+
+typedef union
+{
+  uint8_t col[16];
+  uint32_t word[MATRIX_WORDS];
+} MatrixState;
+
+static MatrixState DirectKeyStates, DirectNKeyStates;
+
+// Key events flow from the scanner to the report builder through a
+// single-producer / single-consumer ring. Only the scanner advances
+// EventHead and only the report builder advances EventTail, so the
+// scanner may run from an ISR without locking. Ring slots are plain
+// memory, so RING_BARRIER keeps the compiler from moving a slot access
+// past the volatile index store that publishes or frees the slot.
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+#define KEY_EVENT_UP 0x80       // Set in code for a release.
+#define EVENT_RING_SIZE 32      // Power of two.
+
+typedef struct
+{
+  uint8_t code;                 // Matrix position, | KEY_EVENT_UP.
+  uint16_t ticks;               // HAL_Ticks() when the scan saw it.
+#ifdef LATENCY_STATS
+  uint8_t wraps;                // LatencyWraps then.
+#endif
+} KeyEvent;
+
+// Debounce with 2-bit vertical counters: bit n of DebounceCt0/Ct1[c] is
+// the counter for key (c, n), so one column of eight keys is handled with
+// a few byte-wide logic ops. Deferred mode (default) reports a change once
+// it has been seen on DEBOUNCE_SCANS consecutive scans. Eager mode
+// (-DDEBOUNCE_EAGER) reports it at once and then ignores that key for
+// DEBOUNCE_SCANS - 1 further scans.
+#ifndef DEBOUNCE_SCANS
+#define DEBOUNCE_SCANS 4
+#endif
+#if DEBOUNCE_SCANS < 1 || DEBOUNCE_SCANS > 4
+#error "DEBOUNCE_SCANS must be 1..4"
+#endif
+#define DEBOUNCE_R0 (((DEBOUNCE_SCANS - 1) & 1) ? 0xFF : 0x00)
+#define DEBOUNCE_R1 (((DEBOUNCE_SCANS - 1) & 2) ? 0xFF : 0x00)
+
+static MatrixState DebounceState;
+static uint8_t DebounceCt0[16], DebounceCt1[16];
+static uint8_t DebounceBusy;    // Any counter mid-run during the last pass.
+
+static KeyEvent EventRing[EVENT_RING_SIZE];
+static volatile uint8_t EventHead, EventTail;
+static uint16_t EventOverflows;
+static uint8_t EventDepthMax;
+
+// Raw events get their own ring, filled next to EventRing by the scanner
+// and emptied by the raw interface. A full ring drops the event rather
+// than holding up the keyboard.
+#ifdef RAW_EVENTS
+#define RAW_RING_SIZE 32        // Power of two.
+#if 1000 % HAL_TICK_NS != 0
+#error "RAW_EVENTS needs HAL_TICK_NS to divide 1000"
+#endif
+#define RAW_TICKS_PER_US (1000 / HAL_TICK_NS)
+
+static RawEvent_t RawRing[RAW_RING_SIZE];
+static volatile uint8_t RawHead, RawTail;
+static volatile uint8_t RawDropped;     // Scanner only; wraps.
+static uint8_t RawDroppedSent, RawSequence;
+static uint32_t RawUsec;
+static uint16_t RawTicksLast, RawTicksRem;
+#endif
+
+// Telemetry counters; see TelemetryReport_t.
+static uint32_t ScanCount, ScanCountMark, ScansPerSec;
+static uint16_t SofCount;
+static volatile uint8_t FrameClock;     // SOF count, for millisecond timing.
+static uint32_t PressEvents, ReleaseEvents, DebounceSuppressed;
+static uint16_t RolloverReports;
+static uint16_t ColumnChatter[16];
+
+// Boot timing probe: microseconds from Direct_Init starting Timer1, just
+// after reset, to the first USB configuration and to the first IN report.
+// Boot_Clock extends HAL_Ticks and has to run at least once per wrap of
+// the 16-bit tick (32 ms at 16 MHz) until the first report; the main loop
+// and Settle_Calibrate call it.
+static uint32_t BootUsec, BootConfiguredUs, BootReportUs;
+static uint16_t BootTicksLast, BootNsRem;
+static bool BootConfigured, BootReported;
+
+// Scan trace (-DTRACE_RECORD): raw matrix snapshots, as read into
+// DirectNKeyStates before debounce, captured into a RAM ring for replay
+// through the host build. A sample is stored only when the snapshot
+// changes; Scans counts the scans since the previous sample, so the
+// unchanged ones in between can be reproduced. Writing 1 to Feature report
+// TRACE_REPORT_ID clears the ring and starts recording, 0 stops it, and a
+// full ring stops it too. Each read of that report pops the oldest sample.
+// A trace file is TRACE_MAGIC followed by the samples (see TraceSample).
+#ifdef TRACE_RECORD
+#ifndef TRACE_DEPTH
+#define TRACE_DEPTH 16          // Power of two, at most 128.
+#endif
+#define TRACE_FLAG_ARMED (1 << 0)
+#define TRACE_FLAG_FULL  (1 << 1)       // Recording stopped on a full ring.
+#define TRACE_FLAG_START (1 << 2)       // Next scan is the first sample.
+
+static TraceSample TraceRing[TRACE_DEPTH];
+static volatile uint8_t TraceHead, TraceTail;
+static volatile uint8_t TraceFlags;
+static MatrixState TraceLast;
+static uint16_t TraceScans;
+#endif
 
-#define SC_ADDR_DDR DDRB
-#define SC_ADDR_PORT PORTB
-#define SC_ADDR_SHIFT 4
-#define SC_STROBE_DDR DDRB
-#define SC_STROBE_PORT PORTB
-#define SC_STROBE (1 << 0)
-#define SC_KEYS_PIN PIND
+// Key-to-report latency (-DLATENCY_STATS): ticks from the scan that saw a
+// change to the report callback that applied it, counted in
+// LATENCY_BUCKETS linear buckets of 2^LATENCY_BUCKET_SHIFT ticks; the last
+// bucket also takes everything beyond. The scanner counts wraps of the
+// 16-bit tick in LatencyWraps and stamps each event with the count, so a
+// wait of a whole wrap or more (32.8 ms at 16 MHz) also lands in the last
+// bucket rather than wrapping. Also tracks the period between scan
+// starts. Without the option the hooks compile away.
+#ifdef LATENCY_STATS
+#define LATENCY_BUCKETS 16
+#ifndef LATENCY_BUCKET_SHIFT
+#define LATENCY_BUCKET_SHIFT 9  // 256 us per bucket at F_CPU/8 and 16 MHz.
+#endif
 
+static uint16_t LatencyHist[LATENCY_BUCKETS];
+static volatile uint8_t LatencyWraps;   // Scanner only; wraps.
+static uint16_t LatencyTicksLast;
+static uint16_t ScanPeriodMin = 0xFFFF, ScanPeriodMax, ScanPeriodLastStart;
+static uint64_t ScanPeriodSum;
+static uint32_t ScanPeriodCount;
+
+// Scanner only, with each scan's start and each event's stamp, so the
+// tick cannot wrap twice between calls.
+#define LATENCY_CLOCK(now)                                      \
+  do {                                                          \
+    if ((uint16_t)(now) < LatencyTicksLast) LatencyWraps++;     \
+    LatencyTicksLast = (now);                                   \
+  } while (0)
+
+// A wrap counted since the event, with the tick back past its stamp, or
+// two wraps, mean a whole wrap has gone by. The report side's 'now' may
+// be past a wrap the scanner has not counted yet; that wrap shows as
+// 'now' below the stamp with one wrap fewer, and is still told apart.
+#define LATENCY_RECORD(now, event)                              \
+  do {                                                          \
+    uint8_t _w = LatencyWraps - (event)->wraps;                 \
+    uint16_t _b = (uint16_t)((now) - (event)->ticks) >> LATENCY_BUCKET_SHIFT; \
+    if (_w > ((now) < (event)->ticks ? 1 : 0) || _b >= LATENCY_BUCKETS) \
+      _b = LATENCY_BUCKETS - 1;                                 \
+    if (LatencyHist[_b] != 0xFFFF) LatencyHist[_b]++;           \
+  } while (0)
+
+#define SCAN_PERIOD_RECORD(start)                               \
+  do {                                                          \
+    uint16_t _p = (start) - ScanPeriodLastStart;                \
+    ScanPeriodLastStart = (start);                              \
+    if (ScanPeriodCount == 0xFFFFFFFF)                          \
+      break;                    /* Stop at the first wrap. */   \
+    if (ScanPeriodCount++ == 0)                                 \
+      break;                    /* No previous start yet. */    \
+    ScanPeriodSum += _p;                                        \
+    if (_p < ScanPeriodMin) ScanPeriodMin = _p;                 \
+    if (_p > ScanPeriodMax) ScanPeriodMax = _p;                 \
+  } while (0)
+#else
+#define LATENCY_CLOCK(now) ((void)0)
+#define LATENCY_RECORD(now, event) ((void)0)
+#define SCAN_PERIOD_RECORD(start) ((void)0)
+#endif
 
-static uint8_t DirectKeyStates[16], DirectNKeyStates[16];
+// Simulator image (-DSIM_BUILD) for tools/simcycles: no USB; the main loop
+// polls the report callbacks directly. Functions with a cycle budget are
+// kept out of line so they have a symbol to measure, and so are the boot
+// probe's marks, whose first call simcycles timestamps.
+#ifdef SIM_BUILD
+#define SIM_MEASURED __attribute__((noinline))
+#else
+#define SIM_MEASURED
+#endif
 
-static void KeyDown(const KeyInfo *key, bool noKeyUps);
-static void KeyUp(const KeyInfo *key);
-static uint8_t Direct_Read(uint8_t column);
+static void KeyDown(uint8_t pos) SIM_MEASURED;
+static void KeyUp(uint8_t pos) SIM_MEASURED;
 static void Direct_Init(void);
-static void Direct_Scan(void);
+static void Direct_Scan(void) SIM_MEASURED;
+static void Direct_Column(uint8_t column, uint8_t keys);
+static void Boot_Configured(void) SIM_MEASURED;
+static void Boot_Reported(void) SIM_MEASURED;
 //static bool IsKeyDown(HidUsageID key);
-static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport);
+static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport) SIM_MEASURED;
+#ifdef NKRO_REPORT
+static void AddNKROReport(USB_KeyboardNKROReport_Data_t* NKROReport) SIM_MEASURED;
+#endif
 void SetupHardware(void);
 bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const,
                                          uint8_t* const,
                                          const uint8_t ,
                                          void* , uint16_t* const);
+void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const,
+                                          const uint8_t,
+                                          const uint8_t,
+                                          const void*, const uint16_t);
 #define LOW 0
 #define HIGH 1
 
-static const KeyInfo Keys[128] PROGMEM = {
-    
+// Keymap tables from tools/keymapgen; the host checks build against
+// host/checkmap.h.
+#ifndef KEYMAP
+#define KEYMAP "keymap.h"
+#endif
+#include KEYMAP
+
+// Layer for new presses: the highest LAYER_n key held, else BaseLayer.
+// Each press records the layer it used so its release reads the same
+// entry, whatever the layer is by then.
+static uint8_t BaseLayer, ActiveLayer;
+#if KEY_LAYERS > 1
+static uint8_t KeyLayer[128];
+#define KEY_LAYER(pos) (KeyLayer[pos])
+#else
+#define KEY_LAYER(pos) 0
+#endif
+
+// Runtime keymap (-DKEYMAP_EEPROM). The live keymap is a RAM copy, loaded
+// at boot from the later of two valid EEPROM slots, or from Keys[] if
+// neither is valid. Feature report KEYMAP_REPORT_ID stages edits into the
+// other slot, which COMMIT makes live once its checksum matches. A slot's
+// magic byte is cleared before staging and written last when sealing, so
+// a reset at any point leaves a complete keymap in charge. The EEPROM
+// work runs a byte at a time from the main loop; see Keymap_Task.
+#ifdef KEYMAP_EEPROM
+#define KEYMAP_MAGIC 0x4B
+#define KEYMAP_COMPARE_PER_CALL 16      // EEPROM bytes checked per Keymap_Task.
+#define KEYMAP_NO_SLOT 0xFF
+
+#define KEYMAP_OP_READ    0     // Point the next GET at Layer / Position.
+#define KEYMAP_OP_WRITE   1     // Stage Count entries at Layer / Position.
+#define KEYMAP_OP_DEFAULT 2     // Stage Keys[] in full.
+#define KEYMAP_OP_COMMIT  3     // Go live if the staged checksum is Check.
+
+#define KEYMAP_STATUS_BUSY    (1 << 0)  // EEPROM work running; only READ is taken.
+#define KEYMAP_STATUS_STAGED  (1 << 1)  // A staged keymap waits for COMMIT.
+#define KEYMAP_STATUS_REFUSED (1 << 2)  // The last SET was refused.
+#define KEYMAP_STATUS_DEFAULT (1 << 3)  // The live keymap is Keys[].
+
+typedef struct
+{
+  uint8_t Magic;                // KEYMAP_MAGIC once the slot is sealed.
+  uint8_t Sequence;             // Of two valid slots, the later one wins.
+  uint8_t Layers;               // KEY_LAYERS of the firmware that wrote it.
+  uint16_t Check;               // Of Keys, see Keymap_CheckStep.
+} ATTR_PACKED KeymapHeader;
 
-    PC_KEY(000, HID_KEYBOARD_SC_DOT_AND_GREATER_THAN_SIGN,NULL), //>
-    PC_KEY(001, HID_KEYBOARD_SC_SEMICOLON_AND_COLON, NULL), // HELP
-    PC_KEY(002, HID_KEYBOARD_SC_P, NULL),
-    PC_KEY(003, HID_KEYBOARD_SC_0_AND_CLOSING_PARENTHESIS, NULL), // CAPS-LOCK
-    PC_KEY(004, HID_KEYBOARD_SC_COMMA_AND_LESS_THAN_SIGN, NULL), // BOLD-LOCK (shift key? LED?)
-    PC_KEY(005, HID_KEYBOARD_SC_L, NULL), //l
-    PC_KEY(006, HID_KEYBOARD_SC_O, NULL), // O
-    PC_KEY(007, HID_KEYBOARD_SC_9_AND_OPENING_PARENTHESIS, NULL), // 9
-    PC_KEY(010, HID_KEYBOARD_SC_SPACE, NULL),
-    PC_KEY(011, HID_KEYBOARD_SC_Z, NULL), // 
-    SHIFT_KEY(012, HID_KEYBOARD_SC_LOCKING_NUM_LOCK , ALT_LOCK), // broken key numlock
-    PC_KEY(013, HID_KEYBOARD_SC_KEYPAD_9_AND_PAGE_UP, NULL), // 9 and )
-    PC_KEY(014,HID_KEYBOARD_SC_Z,NULL),
-    PC_KEY(015, HID_KEYBOARD_SC_A, NULL), // A
-    PC_KEY(016, HID_KEYBOARD_SC_Q, NULL), // Q
-    PC_KEY(017, HID_KEYBOARD_SC_1_AND_EXCLAMATION, NULL), //1 and !
-    PC_KEY(018, HID_KEYBOARD_SC_TAB, NULL), // TAB
-    PC_KEY(019,HID_KEYBOARD_SC_X,NULL), 
-    PC_KEY(022,HID_KEYBOARD_SC_Y,NULL), 
-    PC_KEY(023, HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NULL), // `
-    PC_KEY(024, HID_KEYBOARD_SC_V, NULL), // V
-    PC_KEY(025, HID_KEYBOARD_SC_G, NULL), // G
-    PC_KEY(026, HID_KEYBOARD_SC_T, NULL), // T
-    PC_KEY(027, HID_KEYBOARD_SC_5_AND_PERCENTAGE, NULL), // F4
-    PC_KEY(028,HID_KEYBOARD_SC_G, NULL), 
-    PC_KEY(029,HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NULL), //nothing
-    PC_KEY(030,HID_KEYBOARD_SC_I, NULL), 
-    PC_KEY(033,HID_KEYBOARD_SC_3_AND_HASHMARK, NULL),//3 and pound 
-    PC_KEY(034, HID_KEYBOARD_SC_6_AND_CARET , NULL), // LEFT-CONTROL
-    PC_KEY(035, HID_KEYBOARD_SC_HOME, NULL ), // RIGHT-CONTROL
-    PC_KEY(036,HID_KEYBOARD_SC_Y, NULL),//Y 
-    PC_KEY(037,HID_KEYBOARD_SC_O, NULL),
-    PC_KEY(038,HID_KEYBOARD_SC_O, NULL),
-    PC_KEY(041, HID_KEYBOARD_SC_BACKSLASH_AND_PIPE, NULL), // num lock ??
-    PC_KEY(042, HID_KEYBOARD_SC_CLOSING_BRACKET_AND_CLOSING_BRACE, NULL),
-    PC_KEY(043, HID_KEYBOARD_SC_GRAVE_ACCENT_AND_TILDE, NULL), // ALT (ESCAPE actually?)
-    PC_KEY(044, HID_KEYBOARD_SC_N, NULL), // N
-    PC_KEY(045, HID_KEYBOARD_SC_J, NULL), // J
-    PC_KEY(046, HID_KEYBOARD_SC_U, NULL), // U
-    PC_KEY(047, HID_KEYBOARD_SC_7_AND_AMPERSAND,NULL), //7 and backtick
-    PC_KEY(048, HID_KEYBOARD_SC_B,NULL), 
-    PC_KEY(049, HID_KEYBOARD_SC_C,NULL), 
-    PC_KEY(050, HID_KEYBOARD_SC_D,NULL), 
-    PC_KEY(053, HID_KEYBOARD_SC_O,NULL), // broken Key
-    PC_KEY(054, HID_KEYBOARD_SC_E,NULL), 
-    PC_KEY(055, HID_KEYBOARD_SC_F,NULL), 
-    PC_KEY(056, HID_KEYBOARD_SC_G,NULL), 
-    PC_KEY(057, HID_KEYBOARD_SC_KEYPAD_ASTERISK,NULL), //nothing 
-    PC_KEY(058,HID_KEYBOARD_SC_I,NULL), 
-    PC_KEY(061, HID_KEYBOARD_SC_KEYPAD_2_AND_DOWN_ARROW, NULL), // 2
-    PC_KEY(062, HID_KEYBOARD_SC_KEYPAD_5, NULL), // 5
-    PC_KEY(063, HID_KEYBOARD_SC_KEYPAD_7_AND_HOME, NULL), // 7
-    PC_KEY(064, HID_KEYBOARD_SC_X, NULL),//D 
-    PC_KEY(064, HID_KEYBOARD_SC_D, NULL),//X 
-    PC_KEY(066, HID_KEYBOARD_SC_E, NULL), // E
-    PC_KEY(067, HID_KEYBOARD_SC_3_AND_HASHMARK,NULL), //num 3
-    PC_KEY(068, HID_KEYBOARD_SC_K,NULL),  
-    PC_KEY(071, HID_KEYBOARD_SC_O, NULL), 
-    PC_KEY(072, HID_KEYBOARD_SC_F14, NULL ),//f14 
-    PC_KEY(073, HID_KEYBOARD_SC_F13, NULL), //f13
-    PC_KEY(074, HID_KEYBOARD_SC_F12, NULL), //f12
-    PC_KEY(075, HID_KEYBOARD_SC_F11, NULL), //f11
-    PC_KEY(076, HID_KEYBOARD_SC_F10, NULL), //F10
-    PC_KEY(077, HID_KEYBOARD_SC_F9, NULL), //F9
-    PC_KEY(100, HID_KEYBOARD_SC_SLASH_AND_QUESTION_MARK, NULL),//forward slash
-    PC_KEY(101, HID_KEYBOARD_SC_KEYPAD_ASTERISK, NULL), //check is this real b??
-    PC_KEY(102, HID_KEYBOARD_SC_OPENING_BRACKET_AND_OPENING_BRACE, NULL), //Bracket
-    PC_KEY(103, HID_KEYBOARD_SC_B, NULL), //B
-    PC_KEY(104, HID_KEYBOARD_SC_M, NULL), //M
-    PC_KEY(105, HID_KEYBOARD_SC_K, NULL),//K
-    PC_KEY(106, HID_KEYBOARD_SC_I, NULL), //I
-    PC_KEY(107, HID_KEYBOARD_SC_8_AND_ASTERISK, NULL), //8
-    SHIFT_KEY(145, HID_KEYBOARD_SC_RIGHT_GUI, R_SUPER), //right shift
-    SHIFT_KEY(165, HID_KEYBOARD_SC_RIGHT_ALT, R_META), //rept
-    SHIFT_KEY(020, HID_KEYBOARD_SC_LEFT_CONTROL, L_CONTROL), // left control 
-    PC_KEY(113,HID_KEYBOARD_SC_K, NULL), //
-    SHIFT_KEY(114, HID_KEYBOARD_SC_LEFT_SHIFT, L_SHIFT), //SHIFT
-    SHIFT_KEY(125, HID_KEYBOARD_SC_RIGHT_SHIFT, R_SHIFT),//SHIFT LOCK
-    PC_KEY(116, HID_KEYBOARD_SC_TAB, NULL), //TAB
-    SHIFT_KEY(125, HID_KEYBOARD_SC_CAPS_LOCK, CAPS_LOCK), //caps lock
-    PC_KEY(121, HID_KEYBOARD_SC_KEYPAD_0_AND_INSERT, NULL), //num 0
-    PC_KEY(122,HID_KEYBOARD_SC_KEYPAD_1_AND_END, NULL), //num 1
-    PC_KEY(123, HID_KEYBOARD_SC_KEYPAD_4_AND_LEFT_ARROW, NULL), //num 4 
-    PC_KEY(124, HID_KEYBOARD_SC_M, NULL), // 
-    PC_KEY(125, HID_KEYBOARD_SC_C, NULL), // C
-    PC_KEY(126, HID_KEYBOARD_SC_F, NULL), // F
-    PC_KEY(127, HID_KEYBOARD_SC_R, NULL), // R
-    PC_KEY(130, HID_KEYBOARD_SC_4_AND_DOLLAR, NULL), //num 4 
-    PC_KEY(131,HID_KEYBOARD_SC_X, NULL), //
-    PC_KEY(132,HID_KEYBOARD_SC_Y, NULL), //
-    PC_KEY(133,HID_KEYBOARD_SC_Z, NULL), //
-    PC_KEY(134,HID_KEYBOARD_SC_O, NULL), //
-    PC_KEY(135, HID_KEYBOARD_SC_KEYPAD_2_AND_DOWN_ARROW, NULL), // down 
-    PC_KEY(136,HID_KEYBOARD_SC_N, NULL), // 
-    PC_KEY(137, HID_KEYBOARD_SC_BACKSPACE, NULL), // 
-    PC_KEY(140,HID_KEYBOARD_SC_P, NULL), // 
-    PC_KEY(141, HID_KEYBOARD_SC_LEFT_ARROW, NULL), // 
-    PC_KEY(142, HID_KEYBOARD_SC_ENTER, NULL), // enter
-    PC_KEY(143, HID_KEYBOARD_SC_MINUS_AND_UNDERSCORE, NULL), //minus 
-    PC_KEY(144,HID_KEYBOARD_SC_DELETE, NULL),//bell off, *delete
-    PC_KEY(145,HID_KEYBOARD_SC_EQUAL_AND_PLUS, NULL),//equal dash
-    PC_KEY(146,HID_KEYBOARD_SC_KEYPAD_6_AND_RIGHT_ARROW, NULL), //right arrow
-
-// SHIFT_KEY(147, HID_KEYBOARD_SC_LEFT_SHIFT, L_SHIFT), // LEFT-SHIFT
-    PC_KEY(150, HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NULL), //up arrow
-    PC_KEY(151, HID_KEYBOARD_SC_DOWN_ARROW, NULL), //down arrow
-    PC_KEY(152,HID_KEYBOARD_SC_S, NULL), //
-    PC_KEY(153,HID_KEYBOARD_SC_T, NULL), //
-    PC_KEY(154,HID_KEYBOARD_SC_U, NULL), //
-    PC_KEY(155,HID_KEYBOARD_SC_V, NULL), //
-    PC_KEY(156, HID_KEYBOARD_SC_RIGHT_ARROW, NULL), //edit right
-    PC_KEY(157, HID_KEYBOARD_SC_H, NULL), //H
-    PC_KEY(160, HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NULL), //up arrow
-    PC_KEY(161, HID_KEYBOARD_SC_O, NULL), //
-    PC_KEY(162, HID_KEYBOARD_SC_KEYPAD_DOT_AND_DELETE, NULL), // period
-    PC_KEY(163,HID_KEYBOARD_SC_KEYPAD_3_AND_PAGE_DOWN, NULL),//num 3
-    PC_KEY(164,HID_KEYBOARD_SC_6_AND_CARET, NULL), //  
-    PC_KEY(165, HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NULL), //num 8 
-    PC_KEY(166, HID_KEYBOARD_SC_Z, NULL), // Z
-    PC_KEY(167, HID_KEYBOARD_SC_S, NULL), // S
-    PC_KEY(170, HID_KEYBOARD_SC_W, NULL), // W
-    PC_KEY(171,HID_KEYBOARD_SC_2_AND_AT, NULL),//2
-    PC_KEY(172,HID_KEYBOARD_SC_F16, NULL),//F1
-    PC_KEY(173, HID_KEYBOARD_SC_F20, NULL), //F2 
-    PC_KEY(174,HID_KEYBOARD_SC_F18, NULL),//F3
-    PC_KEY(175, HID_KEYBOARD_SC_STOP, NULL), //F4 
-    PC_KEY(176, HID_KEYBOARD_SC_F5, NULL), // last page
-    PC_KEY(177, HID_KEYBOARD_SC_ESCAPE, NULL) // end
-
-    };
-
-
-static bool NonLockingKeyDown(void)
+typedef struct
 {
-  int i;
-  for (i = 0; i < NKeysDown; i++)
+  KeymapHeader Header;
+  KeyEntry Keys[KEY_LAYERS][128];
+} ATTR_PACKED KeymapSlot;
+
+#if defined(E2END) && 2 * (5 + 256 * KEY_LAYERS) > E2END + 1 - 64
+#error "KEYMAP_EEPROM keeps two copies of the keymap; they do not fit the EEPROM"
+#endif
+
+#ifndef HOST_BUILD
+static KeymapSlot EEMEM KeymapEE[2];
+#define KEYMAP_EE_READY()       eeprom_is_ready()
+#define KEYMAP_EE_READ(p)       eeprom_read_byte(p)
+#define KEYMAP_EE_WRITE(p,v)    eeprom_write_byte(p, v)
+#else
+static KeymapSlot KeymapEE[2];  // Stands in for the EEPROM.
+#define KEYMAP_EE_READY()       true
+#define KEYMAP_EE_READ(p)       (*(p))
+#define KEYMAP_EE_WRITE(p,v)    (*(p) = (v))
+#endif
+
+// Each step of the EEPROM work brings KeymapLeft bytes of the staging slot
+// at KeymapDst in line with KeymapSrc, last byte first.
+typedef enum {
+  KEYMAP_IDLE,
+  KEYMAP_INVALIDATE,            // Clear the staging slot's magic.
+  KEYMAP_COPY,                  // Copy the live keymap, or Keys[], into it.
+  KEYMAP_EDIT,                  // Write KeymapEdit's entries into it.
+  KEYMAP_VERIFY,                // Check it against KeymapSeal.Check.
+  KEYMAP_SEAL                   // Write KeymapSeal into its header.
+} KeymapStep;
+
+static KeyEntry Keymap[KEY_LAYERS][128];        // Live.
+static uint16_t KeymapCheck;                    // Of Keymap.
+static uint8_t KeymapLive = KEYMAP_NO_SLOT;     // Slot Keymap was loaded from.
+static uint8_t KeymapSequence;                  // That slot's Sequence.
+static uint8_t KeymapStatus;                    // STAGED | REFUSED.
+static uint8_t KeymapReadLayer, KeymapReadPos;
+
+static KeymapStep KeymapStepNow;
+static const uint8_t* KeymapSrc;
+static bool KeymapSrcFlash;
+static uint8_t* KeymapDst;
+static uint16_t KeymapLeft;
+static bool KeymapCopyDefault;                  // COPY reads Keys[].
+static bool KeymapEditPending;
+static KeymapReport_t KeymapEdit;
+static KeymapHeader KeymapSeal;
+static const uint8_t KeymapBlank = 0xFF;
+
+#define KEYMAP_ENTRY(layer, pos) (Keymap[layer][pos])
+#else
+#define KEYMAP_ENTRY(layer, pos) ((KeyEntry)pgm_read_word(&Keys[layer][pos]))
+#endif
+
+static void Layer_Update(void)
+{
+  if (CurrentShifts & SHIFT(LAYER_3))
+    ActiveLayer = 3;
+  else if (CurrentShifts & SHIFT(LAYER_2))
+    ActiveLayer = 2;
+  else if (CurrentShifts & SHIFT(LAYER_1))
+    ActiveLayer = 1;
+  else
+    ActiveLayer = BaseLayer;
+}
+
+static void UsageAdd(HidUsageID usage)
+{
+  if (usage == 0 || usage >= USAGE_LIMIT)
+    return;                     // 0 is NONE in the keymap.
+  if (UsageRefs[usage]++ == 0)
+  {
+    UsageDown[usage >> 3] |= (1 << (usage & 7));
+    NKeysDown++;
+  }
+}
+
+static void UsageRemove(HidUsageID usage)
+{
+  if (usage == 0 || usage >= USAGE_LIMIT || UsageRefs[usage] == 0)
+    return;
+  if (--UsageRefs[usage] == 0)
+  {
+    UsageDown[usage >> 3] &= ~(1 << (usage & 7));
+    NKeysDown--;
+  }
+}
+
+// Typematic repeat (-DTYPEMATIC). A plain key repeats while held if its
+// keymap entry is flagged "repeat", after TYPEMATIC_DELAY_MS, or while a
+// REPEAT shift key is held, from the next period on. Each repeat releases
+// and re-presses the key's usage, one step per report so the host sees
+// both; the report builder applies them, so the scanner does no extra
+// work and stays the event ring's only producer. The clock is the SOF
+// count, so the rate does not depend on host load, and a late repeat
+// shortens the next interval instead of shifting the cadence.
+#ifdef TYPEMATIC
+#ifndef TYPEMATIC_DELAY_MS
+#define TYPEMATIC_DELAY_MS 500
+#endif
+#ifndef TYPEMATIC_PERIOD_MS
+#define TYPEMATIC_PERIOD_MS 50
+#endif
+#define REPEAT_NONE 0xFF
+
+static uint8_t RepeatSeen;              // FrameClock at the last poll.
+static int16_t RepeatRemaining;         // ms until the next release.
+static uint8_t RepeatPos = REPEAT_NONE, RepeatLast = REPEAT_NONE;
+static HidUsageID RepeatUsage, RepeatLastUsage;
+static bool RepeatAuto;                 // Flagged key; REPEAT not needed.
+static bool RepeatReleased;             // Usage is up until the next poll.
+
+// Stop repeating a key that is still held, putting its usage back.
+static void Repeat_Stop(void)
+{
+  if (RepeatReleased)
+  {
+    UsageAdd(RepeatUsage);
+    KeyStateGeneration++;
+  }
+  RepeatPos = REPEAT_NONE;
+  RepeatReleased = false;
+}
+
+static void Repeat_Start(uint8_t pos, HidUsageID usage, bool autoRepeat, int16_t first)
+{
+  Repeat_Stop();
+  RepeatPos = pos;
+  RepeatUsage = usage;
+  RepeatAuto = autoRepeat;
+  RepeatRemaining = first;
+  RepeatSeen = FrameClock;
+}
+
+// Called by the report builder when no key event was applied.
+static void Repeat_Poll(void)
+{
+  uint8_t now = FrameClock;
+
+  if (RepeatPos == REPEAT_NONE)
+    return;
+  RepeatRemaining -= (uint8_t)(now - RepeatSeen);
+  RepeatSeen = now;
+
+  if (RepeatReleased)
+  {
+    UsageAdd(RepeatUsage);
+    RepeatReleased = false;
+    KeyStateGeneration++;
+    return;
+  }
+  if (RepeatRemaining > 0)
+    return;
+  RepeatRemaining += TYPEMATIC_PERIOD_MS;
+  if (RepeatRemaining <= 0)
+    RepeatRemaining = TYPEMATIC_PERIOD_MS;
+  UsageRemove(RepeatUsage);
+  RepeatReleased = true;
+  KeyStateGeneration++;
+}
+#endif
+
+// Chords, from "chord" lines in the keymap (see tools/keymapgen). A press
+// of a chord member is held back while the held keys could still make a
+// chord, for at most CHORD_WINDOW_MS. The window closes when the held
+// keys make a chord that nothing longer extends, when a key that fits no
+// candidate is pressed or a held key released, or when it runs out. Then
+// either the chord's entry goes out in place of the keys, or the held
+// keys are sent on as presses, one per report and in the order they came,
+// with later events waiting behind them. Keys in no chord are not held.
+// Each event costs a ChordMask lookup and a few mask operations.
+#if KEY_CHORDS > 0
+#ifndef CHORD_WINDOW_MS
+#define CHORD_WINDOW_MS 30
+#endif
+#if CHORD_WINDOW_MS < 1 || CHORD_WINDOW_MS > 255
+#error "CHORD_WINDOW_MS must be 1..255"
+#endif
+#if KEY_CHORDS > 8
+#error "ChordMask holds at most eight chords"
+#endif
+#define CHORD_MAX_KEYS 4
+
+static uint8_t ChordHeld[CHORD_MAX_KEYS];       // Held-back presses, in order.
+static uint8_t ChordCount;                      // Entries in ChordHeld.
+static uint8_t ChordSent;                       // Of those, sent on so far.
+static bool ChordFlushing;                      // Sending ChordHeld on.
+static uint8_t ChordCandidates;                 // Chords the held keys fit.
+static uint8_t ChordStart;                      // FrameClock at the first.
+static uint8_t ChordMembers[16];                // Of fired chords, still down.
+static KeyEntry ChordOutput;
+static bool ChordOutputDown;
+static uint8_t ChordOutputKeys[CHORD_MAX_KEYS]; // The keys that fired it.
+static uint8_t ChordOutputCount;
+
+static bool Chord_Event(uint8_t code);
+#endif
+
+// Macros, from "macro" lines in the keymap (see tools/keymapgen). A key
+// whose shift is MACRO starts one; the report builder then plays it, one
+// step per report when nothing else changed, so scanning goes on and the
+// host gets a report every poll. Each step presses the longest run of
+// taps with rising usages and the same modifiers that fits the report;
+// the report lists usages in rising order, so hosts type them in order.
+// The next run follows directly if it shares no key with this one, and
+// after a release otherwise. Modifiers change in a report of their own.
+// Any key press stops playback.
+#if KEY_MACROS > 0
+#define MACRO_BATCH_MAX 16              // Taps in one NKRO report.
+
+static bool MacroActive;
+static uint16_t MacroPos;               // Next step in MacroSteps.
+static uint8_t MacroDown[MACRO_BATCH_MAX];  // Usages the macro holds.
+static uint8_t MacroDownCount;
+static bool MacroPressed;               // The last step was a press.
+static uint8_t MacroModifiers;          // HID modifier byte, or'ed in.
+static uint8_t MacroWait, MacroWaitStart;   // In FrameClock counts.
+
+static void Macro_Release(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < MacroDownCount; i++)
+    UsageRemove(MacroDown[i]);
+  MacroDownCount = 0;
+  MacroPressed = false;
+}
+
+static void Macro_Start(uint8_t macro)
+{
+  MacroPos = pgm_read_word(&MacroStart[macro]);
+  MacroWait = 0;
+  MacroActive = true;
+#ifdef TYPEMATIC
+  if (RepeatPos != REPEAT_NONE)
+    Repeat_Stop();
+#endif
+}
+
+static void Macro_Stop(void)
+{
+  if (MacroDownCount != 0 || MacroModifiers != 0)
+    KeyStateGeneration++;
+  Macro_Release();
+  MacroModifiers = 0;
+  MacroActive = false;
+}
+
+// Reads the tap at pos into *mods and *usage (0 for modifiers alone) and
+// returns its length in bytes, or 0 at a wait or the end.
+static uint8_t Macro_Tap(uint16_t pos, uint8_t* mods, uint8_t* usage)
+{
+  uint8_t step = pgm_read_byte(&MacroSteps[pos]);
+
+  switch (step)
+  {
+  case MACRO_END:
+  case MACRO_WAIT:
+    return 0;
+  case MACRO_MODS:
+    *mods = pgm_read_byte(&MacroSteps[pos + 1]);
+    *usage = pgm_read_byte(&MacroSteps[pos + 2]) & ~MACRO_SHIFT_BIT;
+    return 3;
+  case MACRO_MODS_TAP:
+    *mods = pgm_read_byte(&MacroSteps[pos + 1]);
+    *usage = 0;
+    return 2;
+  default:
+    *mods = (step & MACRO_SHIFT_BIT) ? HID_KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+    *usage = step & ~MACRO_SHIFT_BIT;
+    return 1;
+  }
+}
+
+// Called by the report builder when nothing else changed; room is how
+// many more usages the report can carry.
+static void Macro_Poll(uint8_t room)
+{
+  uint8_t batch[MACRO_BATCH_MAX];
+  uint8_t n = 0, mods = 0, i, j;
+  uint16_t pos = MacroPos;
+
+  if (!MacroActive)
+    return;
+  if (MacroWait != 0)
+  {
+    if ((uint8_t)(FrameClock - MacroWaitStart) < MacroWait)
+      return;
+    MacroWait = 0;
+  }
+
+  if (room > MACRO_BATCH_MAX)
+    room = MACRO_BATCH_MAX;
+  while (n < room)
+  {
+    uint8_t m, usage, length = Macro_Tap(pos, &m, &usage);
+
+    if (length == 0 ||
+        (n > 0 && (m != mods || usage <= batch[n - 1] || batch[0] == 0)))
+      break;                    // Modifiers tapped alone go alone.
+    mods = m;
+    batch[n++] = usage;
+    pos += length;
+  }
+
+  if (MacroPressed)
   {
-    switch (KeysDown[i])
+    bool alone = MacroDownCount == 0;   // Modifiers were tapped alone.
+    bool shared = alone;
+
+    for (i = 0; i < n; i++)
+      for (j = 0; j < MacroDownCount; j++)
+        if (batch[i] == MacroDown[j])
+          shared = true;
+    Macro_Release();
+    if (n == 0 || shared || mods != MacroModifiers)
     {
-    case HID_KEYBOARD_SC_LOCKING_CAPS_LOCK:
-    case HID_KEYBOARD_SC_LOCKING_NUM_LOCK:
-    case HID_KEYBOARD_SC_LOCKING_SCROLL_LOCK:
-      break;
-    default:
-      return true;
+      // The next run's modifiers go down with this release, unless
+      // modifiers are tapped alone, this time or next.
+      MacroModifiers = (n != 0 && !alone && batch[0] != 0) ? mods : 0;
+      KeyStateGeneration++;
+      return;
     }
   }
-  return false;
+  else if (n == 0)
+  {
+    if (pgm_read_byte(&MacroSteps[MacroPos]) == MACRO_END)
+    {
+      Macro_Stop();
+      return;
+    }
+    MacroWait = pgm_read_byte(&MacroSteps[MacroPos + 1]);
+    MacroWaitStart = FrameClock;
+    MacroPos += 2;
+    return;
+  }
+  else if (mods != MacroModifiers)
+  {
+    MacroModifiers = mods;
+    KeyStateGeneration++;
+    if (batch[0] != 0)
+      return;                   // The keys go in the next report.
+  }
+
+  for (i = 0; i < n; i++)
+    if (batch[i] != 0)
+    {
+      UsageAdd(batch[i]);
+      MacroDown[MacroDownCount++] = batch[i];
+    }
+  MacroPressed = true;
+  MacroPos = pos;
+  KeyStateGeneration++;
 }
+#endif
 
 
-static void KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+// Adds a pressed key's entry to the key state: its shift or layer, and
+// its usage unless it is a modifier or layer key. Macros and repeats are
+// left to the caller.
+static void KeyHold(KeyEntry key)
+{
+  KeyShift shift = KEY_SHIFT(key);
+
+  KeyStateGeneration++;
+  if (shift != NONE)
+  {
+    CurrentShifts |= SHIFT(shift);
+    if (shift >= LAYER_1)
+    {
+      Layer_Update();
+      return;
+    }
+    if (shift <= MAX_USB_SHIFT)
+      return;                   // No need for usage entry.
+  }
+  UsageAdd(KEY_USAGE(key));
+}
+
+static void KeyDown(uint8_t pos)
+{
+  uint8_t layer = ActiveLayer;
+  KeyEntry key = KEYMAP_ENTRY(layer, pos);
+  HidUsageID usage = KEY_USAGE(key);
+  KeyShift shift = KEY_SHIFT(key);
+  uint8_t bit = 1 << (pos & 7);
+
+  if (PhysKeysDown[pos >> 3] & bit)
+    return;                     // Already down.
+  PhysKeysDown[pos >> 3] |= bit;
+#if KEY_LAYERS > 1
+  KeyLayer[pos] = layer;
+#endif
+#if KEY_MACROS > 0
+  if (MacroActive)
+  {
+    Macro_Stop();               // A press cancels playback,
+    if (shift == MACRO)
+      return;                   // and a macro key does nothing more.
+  }
+  else if (shift == MACRO)
+  {
+    Macro_Start(usage);
+    return;
+  }
+#endif
+    KeyHold(key);
+
+#ifdef TYPEMATIC
+    if (shift == REPEAT)
+    {
+      if (RepeatLast != REPEAT_NONE && RepeatPos == REPEAT_NONE)
+        Repeat_Start(RepeatLast, RepeatLastUsage, false, TYPEMATIC_PERIOD_MS);
+    }
+    else if (shift == NONE)
+    {
+      RepeatLast = pos;
+      RepeatLastUsage = usage;
+      if (CurrentShifts & SHIFT(REPEAT))
+        Repeat_Start(pos, usage, false, TYPEMATIC_PERIOD_MS);
+      else if (KEY_REPEATS(key))
+        Repeat_Start(pos, usage, true, TYPEMATIC_DELAY_MS);
+      else if (RepeatPos != REPEAT_NONE)
+        Repeat_Stop();          // The newest key wins.
+    }
+#endif
+    (void)usage;
+    (void)shift;
+}
+
+static uint8_t CurrentModifiers(void)
+{
+  uint8_t shifts;
+
+#define ADD_SHIFT(m,s)          \
+  if (CurrentShifts & SHIFT(s)) \
+    shifts |= m;\
+
+  shifts = 0;
+
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTCTRL,L_CONTROL);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTSHIFT,L_SHIFT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTALT,R_ALT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTGUI,R_GUI);
+ ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTSHIFT,R_SHIFT); 
+#if KEY_MACROS > 0
+  shifts |= MacroModifiers;
+#endif
+  return shifts;
+}
+
+#ifdef NKRO_REPORT
+static void AddNKROReport(USB_KeyboardNKROReport_Data_t* NKROReport)
+{
+  NKROReport->Modifier = CurrentModifiers();
+  memcpy(NKROReport->Bits, UsageDown, sizeof(NKROReport->Bits));
+}
+#endif
+
+static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport)
 {
-  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
-  KeyShift shift = pgm_read_byte(&key->shift);
-  
   
+  int i;
+
+  // Do not even send shifts; they could be out-of-date until the next key down.
+ 
+  KeyboardReport->Modifier = CurrentModifiers();
+
 
-  if (noKeyUps)
+  if (NKeysDown > sizeof(KeyboardReport->KeyCode))
   {
-    NKeysDown = 0;
+    if (!ControlGetReport)
+      RolloverReports++;        // Control reads are not sends.
+    for (i = 0; i < sizeof(KeyboardReport->KeyCode); i++)
+    {
+      KeyboardReport->KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
+    }
   }
-    if (shift != NONE)
+  else
+  {
+    uint8_t n = 0;
+
+    for (i = 0; i < USAGE_BYTES && n < NKeysDown; i++)
     {
-      CurrentShifts |= SHIFT(shift);
-      if (shift <= MAX_USB_SHIFT)
-        return;                  // No need for usage entry.
+      uint8_t bits = UsageDown[i];
+      uint8_t j;
+
+      for (j = 0; bits; j++, bits >>= 1)
+      {
+        if (bits & 1)
+          KeyboardReport->KeyCode[n++] = (i * 8) + j;
+      }
     }
+  }
+ 
+}
+
+// The pipelined and unrolled scans read the matrix themselves; the host
+// build keeps the plain read for scancheck, and FAST_BOOT its column read.
+#if !defined(SCAN_PIPELINED) && (!defined(SCAN_UNROLLED) || defined(HOST_BUILD))
+#define DIRECT_READ_MATRIX
+#endif
+
+#if defined(DIRECT_READ_MATRIX) || defined(FAST_BOOT)
+static uint8_t Direct_Read(uint8_t column)
+{
+  uint8_t p2;
+
+  HAL_SelectColumn(column);
+  HAL_StrobeLow();
+
+#ifdef SETTLE_CALIBRATE
+  {
+    uint16_t strobed = HAL_Ticks();
+    HAL_SettleSince(strobed, COLUMN_SETTLE_TICKS(column));
+  }
+#else
+  HAL_Settle();
+#endif
+
+  p2 = HAL_ReadKeys();
+
+  HAL_StrobeHigh();
+  return p2;
+}
+#endif
+
+#ifdef DIRECT_READ_MATRIX
+static void Direct_ReadMatrix(MatrixState *raw)
+{
+  uint8_t i;
+
+  for (i = 0; i < SC_COLUMNS; i++)
+    raw->col[i] = Direct_Read(i);
+}
+#endif
+
+// With -DSCAN_UNROLLED, the read runs as one straight-line block per
+// column with the port values worked out at compile time: three port
+// writes and a read per column, and no address arithmetic. Columns past
+// SC_COLUMNS drop out at compile time. Reads the same as
+// Direct_ReadMatrix; "scancheck" in the host build compares the two.
+#ifdef SCAN_UNROLLED
+#ifdef SCAN_PIPELINED
+#error "SCAN_UNROLLED replaces the plain scan's read; use one of the two"
+#endif
+#ifdef SETTLE_CALIBRATE
+#define UNROLLED_SETTLE(c)                                      \
+  do {                                                          \
+    uint16_t strobed = HAL_Ticks();                             \
+    HAL_SettleSince(strobed, COLUMN_SETTLE_TICKS(c));           \
+  } while (0)
+#else
+#define UNROLLED_SETTLE(c) HAL_Settle()
+#endif
+#define UNROLLED_COLUMN(c)                                      \
+  if ((c) < SC_COLUMNS)                                         \
+  {                                                             \
+    HAL_WritePort(SC_SELECT(c));                                \
+    HAL_WritePort(SC_STROBED(c));                               \
+    UNROLLED_SETTLE(c);                                         \
+    raw->col[c] = HAL_ReadKeys();                               \
+    HAL_WritePort(SC_SELECT(c));                                \
+  }
+
+static void Direct_ReadUnrolled(MatrixState *raw)
+{
+  UNROLLED_COLUMN(0)  UNROLLED_COLUMN(1)  UNROLLED_COLUMN(2)  UNROLLED_COLUMN(3)
+  UNROLLED_COLUMN(4)  UNROLLED_COLUMN(5)  UNROLLED_COLUMN(6)  UNROLLED_COLUMN(7)
+  UNROLLED_COLUMN(8)  UNROLLED_COLUMN(9)  UNROLLED_COLUMN(10) UNROLLED_COLUMN(11)
+  UNROLLED_COLUMN(12) UNROLLED_COLUMN(13) UNROLLED_COLUMN(14) UNROLLED_COLUMN(15)
+}
+#endif
+
+static void Boot_Clock(void)
+{
+  uint16_t now = HAL_Ticks();
+  uint32_t ns = (uint32_t)(uint16_t)(now - BootTicksLast) * HAL_TICK_NS + BootNsRem;
+
+  BootTicksLast = now;
+  BootUsec += ns / 1000;
+  BootNsRem = ns % 1000;
+}
+
+#ifdef RAW_EVENTS
+// Extends HAL_Ticks to a microsecond count. The scanner calls it on every
+// scan, and RawClock_Keep covers the stretches without scans, so the
+// 16-bit tick counter cannot wrap twice between calls.
+static uint32_t RawClock(uint16_t now)
+{
+  uint32_t ticks = (uint16_t)(now - RawTicksLast) + (uint32_t)RawTicksRem;
+
+  RawTicksLast = now;
+  RawUsec += ticks / RAW_TICKS_PER_US;
+  RawTicksRem = ticks % RAW_TICKS_PER_US;
+  return RawUsec;
+}
+
+// RawClock from outside the scanner: every main loop pass, which also
+// covers idle scans further apart than a tick wrap, and each step of
+// Settle_Calibrate, which stops the scans.
+static void RawClock_Keep(void)
+{
+#ifdef SCAN_TIMER
+  uint8_t CurrentGlobalInt = GetGlobalInterruptMask();
+  GlobalInterruptDisable();
+#endif
+  RawClock(HAL_Ticks());
+#ifdef SCAN_TIMER
+  SetGlobalInterruptMask(CurrentGlobalInt);
+#endif
+}
+#endif
+
+// Only the first configuration and report after reset are timed.
+static void Boot_Configured(void)
+{
+  if (BootConfigured)
+    return;
+  Boot_Clock();
+  BootConfiguredUs = BootUsec;
+  BootConfigured = true;
+}
+
+static void Boot_Reported(void)
+{
+  Boot_Clock();
+  BootReportUs = BootUsec;
+  BootReported = true;
+}
+
+#ifdef SETTLE_CALIBRATE
+static uint8_t Settle_Sample(uint8_t column, uint8_t ticks)
+{
+  uint16_t strobed;
+  uint8_t keys;
+
+  HAL_SelectColumn(column);
+  HAL_StrobeLow();
+  strobed = HAL_Ticks();
+  HAL_SettleSince(strobed, ticks);
+  keys = HAL_ReadKeys();
+  HAL_StrobeHigh();
+  return keys;
+}
+
+static uint8_t Settle_Checksum(const SettleTable *table)
+{
+  uint8_t i, sum = 0;
+
+  for (i = 0; i < 16; i++)
+    sum += table->ticks[i];
+  return ~sum;
+}
+
+static void Settle_Calibrate(void)
+{
+  uint8_t column;
+
+#ifdef SCAN_TIMER
+  TIMSK0 &= ~(1 << OCIE0A);     // Keep the scan ISR off the matrix.
+#endif
+  for (column = 0; column < SC_COLUMNS; column++)
+  {
+    uint8_t previous = column ? column - 1 : SC_COLUMNS - 1;
+    uint8_t ticks, n;
+    bool pressed = false;       // A key of this column was seen down.
+
+    Boot_Clock();               // A column takes well under a tick wrap.
+#ifdef RAW_EVENTS
+    RawClock_Keep();
+#endif
+
+    for (ticks = 0; ticks < SETTLE_MAX_TICKS; ticks++)
+    {
+      for (n = 0; n < SETTLE_SAMPLES; n++)
+      {
+        uint8_t reference = Settle_Sample(column, SETTLE_MAX_TICKS);
+
+        if (reference != 0xFF)
+          pressed = true;
+        Settle_Sample(previous, SETTLE_MAX_TICKS);
+        if (Settle_Sample(column, ticks) != reference)
+          break;
+      }
+      if (n == SETTLE_SAMPLES)
+        break;                  // Stable at this delay.
+    }
+
+    ticks += SETTLE_MARGIN_TICKS;
+    if (ticks > SETTLE_MAX_TICKS)
+      ticks = SETTLE_MAX_TICKS;
+    if (pressed || ticks > ColumnSettle.ticks[column])
+      ColumnSettle.ticks[column] = ticks;
+  }
+  ColumnSettle.magic = SETTLE_MAGIC;
+  ColumnSettle.check = Settle_Checksum(&ColumnSettle);
+#ifndef HOST_BUILD
+  {
+    uint8_t i;
+
+    // A byte at a time, about 3.4 ms each, keeping the clocks going.
+    for (i = 0; i < sizeof(ColumnSettle); i++)
+    {
+      eeprom_update_byte((uint8_t*)&ColumnSettleEE + i, ((const uint8_t*)&ColumnSettle)[i]);
+      Boot_Clock();
+#ifdef RAW_EVENTS
+      RawClock_Keep();
+#endif
+    }
+  }
+#endif
+#ifdef SCAN_TIMER
+  TIMSK0 |= (1 << OCIE0A);
+#endif
+}
+
+static void Settle_Init(void)
+{
+#ifndef HOST_BUILD
+  eeprom_read_block(&ColumnSettle, &ColumnSettleEE, sizeof(ColumnSettle));
+#endif
+  if (ColumnSettle.magic != SETTLE_MAGIC ||
+      ColumnSettle.check != Settle_Checksum(&ColumnSettle))
+  {
+    memset(ColumnSettle.ticks, SC_SETTLE_TICKS, sizeof(ColumnSettle.ticks));
+    Settle_Calibrate();
+  }
+}
+#endif
+
+static void Direct_Init(void)
+{
+  int i;
+
+  HAL_Init();
+  BootTicksLast = HAL_Ticks();
+#ifdef SETTLE_CALIBRATE
+  Settle_Init();
+#endif
+
+  // Everything starts released, so the first scans only report real
+  // presses. Columns past SC_COLUMNS are never read and stay so, which
+  // keeps them out of the idle fast path's comparisons.
+  for (i = 0; i < 16; i++)
+  {
+    DirectNKeyStates.col[i] = 0xFF;
+    DirectKeyStates.col[i] = 0xFF;
+    DebounceState.col[i] = 0xFF;
+#ifndef DEBOUNCE_EAGER
+    DebounceCt0[i] = DEBOUNCE_R0;
+    DebounceCt1[i] = DEBOUNCE_R1;
+#endif
+  }
+
+#ifdef FAST_BOOT
+  // Keys held through power-up have long stopped bouncing, so take them
+  // as debounced if DEBOUNCE_SCANS back-to-back reads all see them down.
+  // The first scan then reports them, and with them the first IN report;
+  // anything still moving is left to the debouncer.
+  {
+    uint8_t n;
+
+    for (i = 0; i < SC_COLUMNS; i++)
+      DebounceState.col[i] = 0;
+    for (n = 0; n < DEBOUNCE_SCANS; n++)
+      for (i = 0; i < SC_COLUMNS; i++)
+        DebounceState.col[i] |= Direct_Read(i);
+  }
+#endif
+}
+
+static bool KeyEvent_Push(uint8_t code, uint16_t ticks)
+{
+  uint8_t head = EventHead;
+  uint8_t depth = (uint8_t)(head - EventTail);
+
+  if (depth >= EVENT_RING_SIZE)
+  {
+    EventOverflows++;
+    return false;
+  }
+  EventRing[head & (EVENT_RING_SIZE - 1)].code = code;
+  EventRing[head & (EVENT_RING_SIZE - 1)].ticks = ticks;
+#ifdef LATENCY_STATS
+  LATENCY_CLOCK(ticks);
+  EventRing[head & (EVENT_RING_SIZE - 1)].wraps = LatencyWraps;
+#endif
+  RING_BARRIER();
+  EventHead = head + 1;         // Publish after the entry is written.
+
+  if (depth + 1 > EventDepthMax)
+    EventDepthMax = depth + 1;
+  return true;
+}
+
+#ifdef RAW_EVENTS
+
+static void RawEvent_Push(uint8_t code, uint16_t ticks)
+{
+  uint8_t head = RawHead;
+  RawEvent_t* event;
+
+  if ((uint8_t)(head - RawTail) >= RAW_RING_SIZE)
+  {
+    RawDropped++;
+    return;
+  }
+  event = &RawRing[head & (RAW_RING_SIZE - 1)];
+  event->Code = code;
+  event->Usec = RawClock(ticks);
+  RING_BARRIER();
+  RawHead = head + 1;
+}
+
+// Fills one report from the ring; false if there is nothing to send.
+static bool RawEvents_Fill(RawEventsReport_t* Report)
+{
+  uint8_t tail = RawTail, dropped = RawDropped;
+  uint8_t n = 0;
+
+  if (tail == RawHead && dropped == RawDroppedSent)
+    return false;
+  while (n < RAW_EVENTS_PER_REPORT && tail != RawHead)
+    Report->Events[n++] = RawRing[tail++ & (RAW_RING_SIZE - 1)];
+  RING_BARRIER();
+  RawTail = tail;
+
+  Report->Version  = RAW_EVENTS_VERSION;
+  Report->Sequence = RawSequence++;
+  Report->Count    = n;
+  Report->Dropped  = dropped - RawDroppedSent;
+  RawDroppedSent = dropped;
+  return true;
+}
+#endif
+
+// With -DREPORT_QUEUE, each IN report carries at most one key-state change
+// and the rest wait in the ring, so a press and release landing between
+// two host polls go out as two reports instead of cancelling out. The
+// endpoint is double banked so the next report is staged while the
+// previous one waits for its IN token. EventOverflows counts the changes
+// the ring could not take.
+// Returns false if the event has to stay queued; see Chord_Event.
+static bool KeyEvent_Dispatch(const KeyEvent *event, uint16_t now)
+{
+  uint8_t code = event->code;
+
+#if KEY_CHORDS > 0
+  if (!Chord_Event(code))
+    return false;
+#else
+  if (code & KEY_EVENT_UP)
+    KeyUp(code & ~KEY_EVENT_UP);
+  else
+    KeyDown(code);
+#endif
+  LATENCY_RECORD(now, event);
+  (void)now;
+  return true;
+}
+
+#ifdef REPORT_QUEUE
+static void KeyEvent_DrainOne(void)
+{
+  uint8_t tail = EventTail;
+  uint16_t generation = KeyStateGeneration;
+  uint16_t now;
+
+  if (tail == EventHead)
+    return;
+  now = HAL_Ticks();
+
+  // Events that change nothing (repeats of a held key) are consumed on
+  // the way to the next real change.
+  while (tail != EventHead && generation == KeyStateGeneration &&
+         KeyEvent_Dispatch(&EventRing[tail & (EVENT_RING_SIZE - 1)], now))
+    tail++;
+  RING_BARRIER();
+  EventTail = tail;
+}
+
+#define KeyEvent_Apply() KeyEvent_DrainOne()
+#else
+#define KeyEvent_Apply() KeyEvent_Drain()
+#endif
+
+// Apply all queued events to the key state. Report builder context only.
+static void KeyEvent_Drain(void)
+{
+  uint8_t tail = EventTail;
+  uint16_t now;
+
+  if (tail == EventHead)
+    return;
+  now = HAL_Ticks();
+
+  while (tail != EventHead &&
+         KeyEvent_Dispatch(&EventRing[tail & (EVENT_RING_SIZE - 1)], now))
+    tail++;
+  RING_BARRIER();
+  EventTail = tail;
+}
+
+static uint8_t Debounce(uint8_t column, uint8_t raw)
+{
+  uint8_t ct0 = DebounceCt0[column];
+  uint8_t ct1 = DebounceCt1[column];
+  uint8_t delta = raw ^ DebounceState.col[column];
+  uint8_t toggle, suppressed;
+
+#ifdef DEBOUNCE_EAGER
+  // Counters hold the remaining lock-out and count down to zero.
+  uint8_t busy = ct0 | ct1;
+
+  toggle = delta & ~busy;
+  suppressed = delta & busy;    // Changes inside the lock-out.
+  ct1 ^= busy & ~ct0;
+  ct0 ^= busy;
+  ct0 = (toggle & DEBOUNCE_R0) | (~toggle & ct0);
+  ct1 = (toggle & DEBOUNCE_R1) | (~toggle & ct1);
+  DebounceBusy |= ct0 | ct1;
+#else
+  // Counters count down while raw differs and reload when it agrees.
+  uint8_t run;
+
+  // A counter that had started and now agrees again was a bounce.
+  suppressed = ~delta & ((ct0 ^ DEBOUNCE_R0) | (ct1 ^ DEBOUNCE_R1));
+  toggle = delta & ~(ct0 | ct1);
+  run = delta & ~toggle;
+  ct1 = (run & (ct1 ^ ~ct0)) | (~run & DEBOUNCE_R1);
+  ct0 = (run & ~ct0) | (~run & DEBOUNCE_R0);
+  DebounceBusy |= run;
+#endif
+
+  if (suppressed)
+  {
+    ColumnChatter[column]++;
+    do
+      DebounceSuppressed++;
+    while (suppressed &= suppressed - 1);
+  }
+
+  DebounceCt0[column] = ct0;
+  DebounceCt1[column] = ct1;
+  return DebounceState.col[column] ^= toggle;
+}
+
+// Index of the lowest set bit in a non-zero nibble.
+static const uint8_t LowBitNibble[16] = { 0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+
+#define LOW_BIT(b) (((b) & 0x0F) ? LowBitNibble[(b) & 0x0F] : 4 + LowBitNibble[(b) >> 4])
+
+static void Direct_Column(uint8_t column, uint8_t keys)
+{
+  uint8_t change;
+  uint16_t now;
+
+  change = keys ^ DirectKeyStates.col[column];
+  if (change == 0) return;
+  now = HAL_Ticks();
+
+  // Visit only the changed bits, lowest first.
+  while (change)
+  {
+    uint8_t j = LOW_BIT(change);
+    uint8_t code = (column * 8) + j;
+
+    change &= change - 1;
+    if (keys & (1 << j))
+      code |= KEY_EVENT_UP;
+    // If the ring is full, leave the old state for this bit so the
+    // change is picked up again on the next scan instead of lost.
+    if (!KeyEvent_Push(code, now))
+    {
+      keys ^= (1 << j);
+      continue;
+    }
+#ifdef RAW_EVENTS
+    RawEvent_Push(code, now);
+#endif
+    if (code & KEY_EVENT_UP)
+      ReleaseEvents++;
+    else
+      PressEvents++;
+  }
+  DirectKeyStates.col[column] = keys;
+}
+
+#if !defined(SCAN_PIPELINED) || defined(TRACE_RECORD) || defined(IDLE_GOVERNOR)
+// True when the two snapshots differ anywhere.
+static bool Matrix_Differs(const MatrixState *a, const MatrixState *b)
+{
+  uint32_t diff = 0;
+  uint8_t i;
+
+  for (i = 0; i < MATRIX_WORDS; i++)
+    diff |= a->word[i] ^ b->word[i];
+  return diff != 0;
+}
+#endif
+
+#ifdef TRACE_RECORD
+// Called by the scanner once DirectNKeyStates holds the whole matrix.
+static void Trace_Record(uint16_t start)
+{
+  TraceSample *sample;
+
+  if (!(TraceFlags & TRACE_FLAG_ARMED))
+    return;
+  TraceScans++;
+  if (!(TraceFlags & TRACE_FLAG_START) && TraceScans != 0xFFFF &&
+      !Matrix_Differs(&DirectNKeyStates, &TraceLast))
+    return;
+  if ((uint8_t)(TraceHead - TraceTail) == TRACE_DEPTH)
+  {
+    TraceFlags = TRACE_FLAG_FULL;
+    return;
+  }
+
+  sample = &TraceRing[TraceHead & (TRACE_DEPTH - 1)];
+  sample->Ticks = start;
+  sample->Scans = TraceScans;
+  memcpy(sample->Matrix, DirectNKeyStates.col, sizeof(sample->Matrix));
+  TraceLast = DirectNKeyStates;
+  TraceScans = 0;
+  TraceFlags &= ~TRACE_FLAG_START;
+  RING_BARRIER();
+  TraceHead++;
+}
+#endif
+
+static void Direct_Scan(void)
+{
+  int i;
+  uint16_t start, ticks;
+
+  start = HAL_Ticks();
+  SCAN_PERIOD_RECORD(start);
+  LATENCY_CLOCK(start);
+#ifdef RAW_EVENTS
+  RawClock(start);
+#endif
+  ScanCount++;
+
+#ifdef SCAN_PIPELINED
+  // Column N+1 is selected and strobed before column N is diffed, so its
+  // settle window overlaps the KeyDown / KeyUp work for column N.
+  {
+    uint16_t strobed;
+
+    HAL_SelectColumn(0);
+    HAL_StrobeLow();
+    strobed = HAL_Ticks();
+    DebounceBusy = 0;
+
+    for (i = 0; i < SC_COLUMNS; i++)
+    {
+      uint8_t keys;
+
+      HAL_SettleSince(strobed, COLUMN_SETTLE_TICKS(i));
+      keys = HAL_ReadKeys();
+      HAL_StrobeHigh();
+
+      if (i < SC_COLUMNS - 1)
+      {
+        HAL_SelectColumn(i + 1);
+        HAL_StrobeLow();
+        strobed = HAL_Ticks();
+      }
+
+      DirectNKeyStates.col[i] = keys;
+      Direct_Column(i, Debounce(i, keys));
+    }
+  }
+#else
+#ifdef SCAN_UNROLLED
+  Direct_ReadUnrolled(&DirectNKeyStates);
+#else
+  Direct_ReadMatrix(&DirectNKeyStates);
+#endif
+
+  // Idle fast path: the raw matrix matches the debounced state, no
+  // debounce counter is running and every change has been queued.
+  if (DebounceBusy ||
+      Matrix_Differs(&DirectNKeyStates, &DebounceState) ||
+      Matrix_Differs(&DebounceState, &DirectKeyStates))
+  {
+    DebounceBusy = 0;
+    for (i = 0; i < SC_COLUMNS; i++)
+    {
+      Direct_Column(i, Debounce(i, DirectNKeyStates.col[i]));
+    }
+  }
+#endif
+#ifdef TRACE_RECORD
+  Trace_Record(start);
+#endif
+#ifdef IDLE_GOVERNOR
+  if (DebounceBusy || Matrix_Differs(&DirectNKeyStates, &DebounceState))
+  {
+    ScanActivity = true;
+    ScanIdle = false;
+  }
+#endif
+
+  ticks = HAL_Ticks() - start;
+  ScanTicksLast = ticks;
+  if (ticks < ScanTicksMin) ScanTicksMin = ticks;
+  if (ticks > ScanTicksMax) ScanTicksMax = ticks;
+}
+
+
+#ifdef SCAN_TIMER
+static void Scan_TimerInit(void)
+{
+  TCCR0A = (1 << WGM01);                // CTC
+  TCCR0B = (1 << CS01) | (1 << CS00);   // F_CPU/64
+  OCR0A = SCAN_TIMER_TOP;
+  TIMSK0 = (1 << OCIE0A);
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+#ifdef IDLE_GOVERNOR
+  static uint8_t skipped;
+
+  if (ScanIdle && ++skipped < IDLE_SCAN_PERIODS)
+    return;
+  skipped = 0;
+#endif
+  Direct_Scan();
+  if (TIFR0 & (1 << OCF0A))
+    ScanOverruns++;
+}
+#endif
+
+
+ static void KeyUp(uint8_t pos)
+ {
+  KeyEntry key = KEYMAP_ENTRY(KEY_LAYER(pos), pos);
+  HidUsageID usage = KEY_USAGE(key);
+  KeyShift shift = KEY_SHIFT(key);
+  uint8_t bit = 1 << (pos & 7);
+
+  if (!(PhysKeysDown[pos >> 3] & bit))
+    return;                     // Not down; nothing to release.
+  PhysKeysDown[pos >> 3] &= ~bit;
+#if KEY_MACROS > 0
+  if (shift == MACRO)
+    return;                     // Playback runs on without the key.
+#endif
+  KeyStateGeneration++;
+
+  if (shift != NONE)
+  {
+    CurrentShifts &= ~SHIFT(shift);
+    if (shift >= LAYER_1)
+    {
+      Layer_Update();
+      return;
+    }
+    if (shift <= MAX_USB_SHIFT)
+      return;                   // Never had a usage entry.
+#ifdef TYPEMATIC
+    if (shift == REPEAT && RepeatPos != REPEAT_NONE && !RepeatAuto)
+      Repeat_Stop();
+#endif
+  }
+
+#ifdef TYPEMATIC
+  if (pos == RepeatLast)
+    RepeatLast = REPEAT_NONE;
+  if (pos == RepeatPos)
+  {
+    bool released = RepeatReleased;
+
+    RepeatPos = REPEAT_NONE;
+    RepeatReleased = false;
+    if (released)
+      return;                   // The repeat already took the usage up.
+  }
+#endif
+  UsageRemove(usage);
+ }
+ 
+#ifdef KEYMAP_EEPROM
+// Rotate left, then add the next byte. Keys are hashed as stored: every
+// entry little-endian, layer by layer, position by position.
+static uint16_t Keymap_CheckStep(uint16_t check, uint8_t b)
+{
+  return (uint16_t)((check << 1) | (check >> 15)) + b;
+}
+
+static uint8_t* Keymap_SlotAddr(uint8_t slot, uint16_t offset)
+{
+  return (uint8_t*)&KeymapEE[slot] + offset;
+}
+
+static void Keymap_ReadHeader(uint8_t slot, KeymapHeader* header)
+{
+  uint8_t i;
+
+  for (i = 0; i < sizeof(KeymapHeader); i++)
+    ((uint8_t*)header)[i] = KEYMAP_EE_READ(Keymap_SlotAddr(slot, i));
+}
+
+static uint16_t Keymap_SlotCheck(uint8_t slot)
+{
+  const uint8_t* keys = Keymap_SlotAddr(slot, offsetof(KeymapSlot, Keys));
+  uint16_t check = 0, i;
+
+  for (i = 0; i < sizeof(Keymap); i++)
+    check = Keymap_CheckStep(check, KEYMAP_EE_READ(keys + i));
+  return check;
+}
+
+static bool Keymap_SlotValid(uint8_t slot, KeymapHeader* header)
+{
+  Keymap_ReadHeader(slot, header);
+  return header->Magic == KEYMAP_MAGIC && header->Layers == KEY_LAYERS &&
+         header->Check == Keymap_SlotCheck(slot);
+}
+
+// The slot edits go to: whichever one the live keymap did not come from.
+static uint8_t Keymap_Staging(void)
+{
+  return KeymapLive == 0 ? 1 : 0;
+}
+
+static void Keymap_Load(uint8_t slot, uint8_t sequence)
+{
+  const uint8_t* keys = Keymap_SlotAddr(slot, offsetof(KeymapSlot, Keys));
+  uint8_t* live = (uint8_t*)Keymap;
+  uint16_t check = 0, i;
+
+  for (i = 0; i < sizeof(Keymap); i++)
+    check = Keymap_CheckStep(check, live[i] = KEYMAP_EE_READ(keys + i));
+  KeymapCheck = check;
+  KeymapLive = slot;
+  KeymapSequence = sequence;
+}
+
+static void Keymap_Init(void)
+{
+  KeymapHeader header[2];
+  uint8_t best = KEYMAP_NO_SLOT, slot;
+  uint16_t check = 0, i;
+
+  for (slot = 0; slot < 2; slot++)
+    if (Keymap_SlotValid(slot, &header[slot]) &&
+        (best == KEYMAP_NO_SLOT ||
+         (int8_t)(header[slot].Sequence - header[best].Sequence) > 0))
+      best = slot;
+  if (best != KEYMAP_NO_SLOT)
+  {
+    Keymap_Load(best, header[best].Sequence);
+    return;
+  }
+
+  for (i = 0; i < sizeof(Keymap); i++)
+    check = Keymap_CheckStep(check, ((uint8_t*)Keymap)[i] =
+                             pgm_read_byte((const uint8_t*)Keys + i));
+  KeymapCheck = check;
+  KeymapLive = KEYMAP_NO_SLOT;
+  KeymapSequence = 0;
+}
+
+static void Keymap_Job(KeymapStep step, const void* src, bool flash,
+                       uint16_t offset, uint16_t length)
+{
+  KeymapStepNow = step;
+  KeymapSrc = (const uint8_t*)src;
+  KeymapSrcFlash = flash;
+  KeymapDst = Keymap_SlotAddr(Keymap_Staging(), offset);
+  KeymapLeft = length;
+}
+
+static void Keymap_Copy(void)
+{
+  if (KeymapCopyDefault)
+    Keymap_Job(KEYMAP_COPY, Keys, true, offsetof(KeymapSlot, Keys), sizeof(Keymap));
+  else
+    Keymap_Job(KEYMAP_COPY, Keymap, false, offsetof(KeymapSlot, Keys), sizeof(Keymap));
+}
+
+static void Keymap_EditJob(void)
+{
+  Keymap_Job(KEYMAP_EDIT, KeymapEdit.Entries, false,
+             offsetof(KeymapSlot, Keys) +
+             ((uint16_t)KeymapEdit.Layer * 128 + KeymapEdit.Position) * sizeof(KeyEntry),
+             KeymapEdit.Count * sizeof(KeyEntry));
+}
+
+// Makes the sealed staging slot live. Held keys are released under the
+// old keymap and held again under the new one, so none is left stuck and
+// each keeps going as whatever the new keymap makes it. Each is looked up
+// on the layer it was pressed on, layer keys first, and holding it again
+// starts no macro or repeat; a held macro key just stays down.
+static void Keymap_Swap(void)
+{
+  uint8_t held[sizeof(PhysKeysDown)];
+  uint8_t pos, pass;
+
+  memcpy(held, PhysKeysDown, sizeof(held));
+  for (pos = 0; pos < 128; pos++)
+    if (held[pos >> 3] & (1 << (pos & 7)))
+      KeyUp(pos);
+  Keymap_Load(Keymap_Staging(), KeymapSeal.Sequence);
+  for (pass = 0; pass < 2; pass++)
+    for (pos = 0; pos < 128; pos++)
+    {
+      KeyEntry key = KEYMAP_ENTRY(KEY_LAYER(pos), pos);
+
+      if (!(held[pos >> 3] & (1 << (pos & 7))) ||
+          (KEY_SHIFT(key) >= LAYER_1 && KEY_SHIFT(key) <= LAYER_3) != (pass == 0))
+        continue;
+      PhysKeysDown[pos >> 3] |= 1 << (pos & 7);
+#if KEY_MACROS > 0
+      if (KEY_SHIFT(key) == MACRO)
+        continue;
+#endif
+      KeyHold(key);
+    }
+}
+
+// Runs the EEPROM work from the main loop. It writes at most one byte per
+// call, and only once the previous write has finished, so nothing ever
+// waits the 3.4 ms a write takes; bytes that already match are skipped,
+// KEYMAP_COMPARE_PER_CALL at a time. The swap itself happens here too, in
+// the same context as the report builder, so a lookup never sees it half
+// done.
+static void Keymap_Task(void)
+{
+  uint8_t n;
+
+  if (KeymapStepNow == KEYMAP_IDLE || !KEYMAP_EE_READY())
+    return;
+  for (n = 0; KeymapLeft > 0 && n < KEYMAP_COMPARE_PER_CALL; n++)
+  {
+    uint16_t i = --KeymapLeft;
+    uint8_t want = KeymapSrcFlash ? pgm_read_byte(KeymapSrc + i) : KeymapSrc[i];
+
+    if (KEYMAP_EE_READ(KeymapDst + i) != want)
+    {
+      KEYMAP_EE_WRITE(KeymapDst + i, want);
+      return;
+    }
+  }
+  if (KeymapLeft > 0)
+    return;
+
+  switch (KeymapStepNow)
+  {
+  case KEYMAP_INVALIDATE:
+    Keymap_Copy();
+    break;
+  case KEYMAP_COPY:
+    KeymapStatus |= KEYMAP_STATUS_STAGED;
+    if (KeymapEditPending)
+      Keymap_EditJob();
+    else
+      KeymapStepNow = KEYMAP_IDLE;
+    break;
+  case KEYMAP_EDIT:
+    KeymapEditPending = false;
+    KeymapStepNow = KEYMAP_IDLE;
+    break;
+  case KEYMAP_VERIFY:
+    if (Keymap_SlotCheck(Keymap_Staging()) != KeymapSeal.Check)
+    {
+      KeymapStatus |= KEYMAP_STATUS_REFUSED;
+      KeymapStepNow = KEYMAP_IDLE;
+      break;
+    }
+    KeymapSeal.Magic = KEYMAP_MAGIC;
+    KeymapSeal.Sequence = KeymapSequence + 1;
+    KeymapSeal.Layers = KEY_LAYERS;
+    Keymap_Job(KEYMAP_SEAL, &KeymapSeal, false, 0, sizeof(KeymapSeal));
+    break;
+  case KEYMAP_SEAL:
+    Keymap_Swap();
+    KeymapStatus &= ~KEYMAP_STATUS_STAGED;
+    KeymapStepNow = KEYMAP_IDLE;
+    break;
+  default:
+    KeymapStepNow = KEYMAP_IDLE;
+    break;
+  }
+}
+
+// Staging starts from the live keymap, or from Keys[] for DEFAULT, and
+// clears the slot's magic first.
+static void Keymap_Stage(bool fromDefault)
+{
+  KeymapCopyDefault = fromDefault;
+  if (KeymapStatus & KEYMAP_STATUS_STAGED)
+  {
+    if (fromDefault)
+      Keymap_Copy();
+    else
+      Keymap_EditJob();
+  }
+  else
+    Keymap_Job(KEYMAP_INVALIDATE, &KeymapBlank, false, 0, 1);
+}
+
+// A SET of the keymap report. Anything but READ is refused while EEPROM
+// work is running; the host polls the status until BUSY clears.
+static void Keymap_Request(const KeymapReport_t* Report, uint16_t ReportSize)
+{
+  bool ok = false;
+  uint8_t i;
+
+  KeymapStatus &= ~KEYMAP_STATUS_REFUSED;
+  if (ReportSize < offsetof(KeymapReport_t, Entries) ||
+      (Report->Code != KEYMAP_OP_READ && KeymapStepNow != KEYMAP_IDLE))
+  {
+    KeymapStatus |= KEYMAP_STATUS_REFUSED;
+    return;
+  }
+
+  switch (Report->Code)
+  {
+  case KEYMAP_OP_READ:
+    if (Report->Layer < KEY_LAYERS && Report->Position < 128)
+    {
+      KeymapReadLayer = Report->Layer;
+      KeymapReadPos = Report->Position;
+      ok = true;
+    }
+    break;
+  case KEYMAP_OP_WRITE:
+    if (Report->Layer >= KEY_LAYERS || Report->Count == 0 ||
+        Report->Count > KEYMAP_ENTRIES_PER_REPORT || Report->Position >= 128 ||
+        Report->Position + Report->Count > 128 ||
+        ReportSize < offsetof(KeymapReport_t, Entries) + Report->Count * sizeof(KeyEntry))
+      break;
+    // A LAYER_n shift past the last layer would index outside Keymap,
+    // and a MACRO past the last macro outside MacroStart.
+    for (i = 0; i < Report->Count; i++)
+    {
+      KeyEntry entry = Report->Entries[i];
+
+      if (KEY_SHIFT(entry) == MACRO ? KEY_USAGE(entry) >= KEY_MACROS
+                                    : KEY_SHIFT(entry) >= LAYER_1 + KEY_LAYERS - 1)
+        break;
+    }
+    if (i < Report->Count)
+      break;
+    memcpy(&KeymapEdit, Report, offsetof(KeymapReport_t, Entries) +
+                                Report->Count * sizeof(KeyEntry));
+    KeymapEditPending = true;
+    Keymap_Stage(false);
+    ok = true;
+    break;
+  case KEYMAP_OP_DEFAULT:
+    KeymapEditPending = false;
+    Keymap_Stage(true);
+    ok = true;
+    break;
+  case KEYMAP_OP_COMMIT:
+    if (!(KeymapStatus & KEYMAP_STATUS_STAGED))
+      break;
+    KeymapSeal.Check = Report->Check;
+    Keymap_Job(KEYMAP_VERIFY, NULL, false, 0, 0);
+    ok = true;
+    break;
+  }
+  if (!ok)
+    KeymapStatus |= KEYMAP_STATUS_REFUSED;
+}
+
+static void Keymap_Fill(KeymapReport_t* Report)
+{
+  uint8_t i, count = 128 - KeymapReadPos;
+
+  if (count > KEYMAP_ENTRIES_PER_REPORT)
+    count = KEYMAP_ENTRIES_PER_REPORT;
+  Report->Code = KeymapStatus;
+  if (KeymapStepNow != KEYMAP_IDLE)
+    Report->Code |= KEYMAP_STATUS_BUSY;
+  if (KeymapLive == KEYMAP_NO_SLOT)
+    Report->Code |= KEYMAP_STATUS_DEFAULT;
+  Report->Layer = KeymapReadLayer;
+  Report->Position = KeymapReadPos;
+  Report->Count = count;
+  Report->Check = KeymapCheck;
+  for (i = 0; i < KEYMAP_ENTRIES_PER_REPORT; i++)
+    Report->Entries[i] = i < count ? Keymap[KeymapReadLayer][KeymapReadPos + i] : 0;
+
+  KeymapReadPos += count;
+  if (KeymapReadPos == 128)
+  {
+    KeymapReadPos = 0;
+    if (++KeymapReadLayer == KEY_LAYERS)
+      KeymapReadLayer = 0;
+  }
+}
+#endif
+
+#if KEY_CHORDS > 0
+// True if a key pressed through KeyDown, and still down, has the shift on
+// the layer it was pressed on. Held-back chord members are not among them.
+static bool Chord_ShiftHeld(KeyShift shift)
+{
+  uint8_t pos;
+
+  for (pos = 0; pos < 128; pos++)
+    if ((PhysKeysDown[pos >> 3] & (1 << (pos & 7))) &&
+        KEY_SHIFT(KEYMAP_ENTRY(KEY_LAYER(pos), pos)) == shift)
+      return true;
+  return false;
+}
+
+// Takes the chord's entry back up; its modifier stays if a key held
+// gives it too.
+static void Chord_Release(void)
+{
+  KeyShift shift = KEY_SHIFT(ChordOutput);
+
+  if (shift != NONE && !Chord_ShiftHeld(shift))
+    CurrentShifts &= ~SHIFT(shift);
+  UsageRemove(KEY_USAGE(ChordOutput));
+  ChordOutputDown = false;
+  KeyStateGeneration++;
+}
+
+// Sends chord c in place of the held keys. Its entry stays down until
+// the first of them is released; the others' releases are swallowed, as
+// are those of an earlier chord's keys once this one has replaced it.
+static void Chord_Fire(uint8_t c)
+{
+  KeyShift shift;
+  uint8_t i;
+
+  if (ChordOutputDown)
+    Chord_Release();            // The newest chord wins.
+  for (i = 0; i < ChordCount; i++)
+  {
+    ChordMembers[ChordHeld[i] >> 3] |= 1 << (ChordHeld[i] & 7);
+    ChordOutputKeys[i] = ChordHeld[i];
+  }
+  ChordOutputCount = ChordCount;
+  ChordCount = 0;
+
+  ChordOutput = pgm_read_word(&ChordEntries[c]);
+  shift = KEY_SHIFT(ChordOutput);
+  if (shift != NONE)
+    CurrentShifts |= SHIFT(shift);
+  UsageAdd(KEY_USAGE(ChordOutput));
+  ChordOutputDown = true;
+  KeyStateGeneration++;
+#ifdef TYPEMATIC
+  if (RepeatPos != REPEAT_NONE)
+    Repeat_Stop();
+#endif
+}
+
+// Ends the window: fire the chord the held keys make, if they make one,
+// or start sending them on.
+static void Chord_Close(void)
+{
+  uint8_t exact = ChordCandidates & pgm_read_byte(&ChordsBySize[ChordCount]);
+
+  ChordCandidates = 0;
+  if (exact)
+    Chord_Fire(LOW_BIT(exact));
+  else
+  {
+    ChordFlushing = true;
+    ChordSent = 0;
+  }
+}
+
+// Called by the report builder before it applies events. Sends on one
+// held key per report while flushing, and closes a window that has run
+// out.
+static void Chord_Poll(void)
+{
+  if (ChordCount != 0 && !ChordFlushing &&
+      (uint8_t)(FrameClock - ChordStart) >= CHORD_WINDOW_MS)
+    Chord_Close();
+  if (!ChordFlushing)
+    return;
+  KeyDown(ChordHeld[ChordSent++]);
+  if (ChordSent == ChordCount)
+  {
+    ChordFlushing = false;
+    ChordCount = 0;
+  }
+}
+
+// Takes one key event; false leaves it in the ring for the next report.
+// That happens behind a flush, and to the event that closes a window, so
+// whatever the window decided is reported first.
+static bool Chord_Event(uint8_t code)
+{
+  uint8_t pos = code & ~KEY_EVENT_UP;
+  uint8_t bit = 1 << (pos & 7);
+  uint8_t mask, exact, i;
+
+  if (ChordFlushing)
+    return false;
+
+  if (code & KEY_EVENT_UP)
+  {
+    if (ChordMembers[pos >> 3] & bit)
+    {
+      ChordMembers[pos >> 3] &= ~bit;
+      for (i = 0; i < ChordOutputCount; i++)
+        if (ChordOutputKeys[i] == pos && ChordOutputDown)
+          Chord_Release();
+      return true;
+    }
+    for (i = 0; i < ChordCount; i++)
+      if (ChordHeld[i] == pos)
+      {
+        Chord_Close();
+        return false;
+      }
+    KeyUp(pos);
+    return true;
+  }
+
+  mask = pgm_read_byte(&ChordMask[pos]);
+  if (ChordCount == 0)
+  {
+    if (mask == 0)
+    {
+      KeyDown(pos);
+      return true;
+    }
+    ChordHeld[0] = pos;
+    ChordCount = 1;
+    ChordCandidates = mask;
+    ChordStart = FrameClock;
+    return true;
+  }
+
+  mask &= ChordCandidates;
+  if (mask == 0 || ChordCount == CHORD_MAX_KEYS)
+  {
+    Chord_Close();
+    return false;
+  }
+  ChordHeld[ChordCount++] = pos;
+  ChordCandidates = mask;
+  exact = mask & pgm_read_byte(&ChordsBySize[ChordCount]);
+  if (exact != 0 && exact == mask)
+    Chord_Fire(LOW_BIT(exact)); // Nothing longer can follow.
+  return true;
+}
+#endif
+
+#if defined(IDLE_GOVERNOR) && !defined(HOST_BUILD)
+// Sleep until the next interrupt if the governor has nothing for the main
+// loop to do. Interrupts stay off from the check to the sleep instruction,
+// so a wake-up that lands in between is not missed.
+static void Idle_Sleep(void)
+{
+  GlobalInterruptDisable();
+  if (ScanIdle && !IdleScanDue)
+  {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    GlobalInterruptEnable();
+    sleep_cpu();
+    sleep_disable();
+  }
+  GlobalInterruptEnable();
+}
+
+EMPTY_INTERRUPT(WDT_vect);
+
+// Runs while the bus is suspended. The watchdog, in interrupt-only mode
+// at its shortest period, paces the scans.
+static void Idle_Suspended(void)
+{
+  bool wakeupSent = false;
+
+#ifdef SCAN_TIMER
+  TIMSK0 &= ~(1 << OCIE0A);
+#endif
+  GlobalInterruptDisable();
+  wdt_reset();
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = (1 << WDIE);
+  GlobalInterruptEnable();
+
+  while (UsbSuspended)
+  {
+    ScanIdle = true;
+    Direct_Scan();
+    if (!ScanIdle)
+    {
+      // Keep scanning at full rate until the host resumes the bus; the
+      // events wait in the ring until then.
+      if (!wakeupSent && USB_Device_RemoteWakeupEnabled)
+      {
+        USB_Device_SendRemoteWakeup();
+        wakeupSent = true;
+      }
+      continue;
+    }
+
+    GlobalInterruptDisable();
+    if (UsbSuspended)
+    {
+      set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+      sleep_enable();
+      GlobalInterruptEnable();
+      sleep_cpu();
+      sleep_disable();
+    }
+    GlobalInterruptEnable();
+  }
+
+  wdt_disable();
+  ScanIdle = false;
+  ScanActivity = true;          // Restart the idle timeout.
+#ifdef SCAN_TIMER
+  TIMSK0 |= (1 << OCIE0A);
+#endif
+}
+#endif
+
+#ifndef HOST_BUILD
+#ifdef SIM_BUILD
+// Stands in for the host: configures on the first pass, then one IN poll
+// per pass of the main loop, and an LED output report every 256 passes.
+static void Sim_Poll(void)
+{
+  static KeyboardReportBuffer_t report;
+  static uint8_t passes;
+  uint8_t reportID = 0;
+  uint16_t reportSize;
+  uint8_t leds;
+
+  if (!BootConfigured)
+  {
+    Boot_Configured();
+    ReportedGeneration = KeyStateGeneration - 1;
+  }
+  memset(&report, 0, sizeof(report));
+  CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                      HID_REPORT_ITEM_In, &report, &reportSize);
+  if (++passes == 0)
+  {
+    leds = HID_KEYBOARD_LED_NUMLOCK;
+    CALLBACK_HID_Device_ProcessHIDReport(&Keyboard_HID_Interface, 0,
+                                         HID_REPORT_ITEM_Out, &leds, 1);
+  }
+}
+#endif
+
+int main(void)                     
+{
+
+      
+     
+      SetupHardware();   
+      GlobalInterruptEnable();
+    
+
+  while(true)
+  {
+    if (!BootReported)
+      Boot_Clock();
+#ifdef RAW_EVENTS
+    RawClock_Keep();
+#endif
+#ifdef IDLE_GOVERNOR
+    if (UsbSuspended)
+      Idle_Suspended();
+#endif
+#ifndef SCAN_TIMER
+#ifdef IDLE_GOVERNOR
+    if (!ScanIdle || IdleScanDue)
+    {
+      IdleScanDue = false;
+      Direct_Scan();
+    }
+#else
+    Direct_Scan();
+#endif
+#endif
+#ifdef SETTLE_CALIBRATE
+    if (SettleCalibrateRequested)
+    {
+      Settle_Calibrate();
+      SettleCalibrateRequested = false;
+    }
+#endif
+#ifdef KEYMAP_EEPROM
+    Keymap_Task();
+#endif
+#ifdef SIM_BUILD
+    Sim_Poll();
+#else
+    HID_Device_USBTask(&Keyboard_HID_Interface);
+#ifdef RAW_EVENTS
+    HID_Device_USBTask(&RawEvents_HID_Interface);
+#endif
+    USB_USBTask();
+#endif
+#ifdef IDLE_GOVERNOR
+    Idle_Sleep();
+#endif
+  }
+
+
+
+}
+#else
+/* Host benchmark: drives the real scan / report core against SimMatrix and
+ * reports scans/sec, events/sec and ns per CreateHIDReport call. With
+ * "replay <trace> [passes]" it instead plays a trace file (see TraceSample)
+ * through the same core, polling for a report after every scan. The
+ * reports from the first pass go to stdout, so two builds can be diffed;
+ * throughput over the remaining passes goes to stderr. With -DRAW_EVENTS,
+ * "rawevents <trace>" plays the trace once and writes the raw interface's
+ * reports to stdout instead, as a stand-in device for tools/rawevents.
+ * "modecheck" checks the reports around mode and format changes; with
+ * -DKEYMAP_EEPROM, "remapcheck" checks a keymap swap with a key held.
+ * Built against host/checkmap.h, "chordcheck" and "macrocheck" check the
+ * chord engine and macro playback. */
+
+#define BENCH_SCANS   1000000L
+#define BENCH_REPORTS 1000000L
+
+static double BenchNow(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Bench_Init(void)
+{
+  int i;
+
+#ifdef KEYMAP_EEPROM
+  Keymap_Init();
+#endif
+  Direct_Init();
+  for (i = 0; i < 16; i++)      // Settle the initial state through the ring.
+  {
+    Direct_Scan();
+    KeyEvent_Drain();
+  }
+  EventOverflows = 0;
+  EventDepthMax = 0;
+}
+
+#ifdef RAW_EVENTS
+static FILE* RawOut;            // Raw interface reports go here if set.
+#endif
+
+// One pass over the trace; returns the number of scans, adds the reports
+// sent to *reports and prints them to out if it is not NULL.
+static long Replay_Pass(const TraceSample* samples, long count, FILE* out, long* reports)
+{
+  KeyboardReportBuffer_t report;
+  uint16_t reportSize, n;
+  uint8_t reportID;
+  long i, scans = 0;
+
+  for (i = 0; i < count; i++)
+  {
+    for (n = samples[i].Scans; n > 0; n--)
+    {
+      if (n == 1)
+        memcpy(SimMatrix, samples[i].Matrix, sizeof(SimMatrix));
+      Direct_Scan();
+      scans++;
+#ifdef KEYMAP_EEPROM
+      Keymap_Task();            // As the main loop's pass.
+#endif
+
+      reportID = 0;
+      memset(&report, 0, sizeof(report));
+#ifdef RAW_EVENTS
+      if (RawOut != NULL)
+      {
+        RawEventsReport_t raw;
+
+        RawClock_Keep();        // As the main loop's pass.
+        reportID = 0;
+        CALLBACK_HID_Device_CreateHIDReport(&RawEvents_HID_Interface, &reportID,
+                                            HID_REPORT_ITEM_In, &raw, &reportSize);
+        if (reportSize != 0)
+          fwrite(&raw, 1, reportSize, RawOut);
+      }
+#endif
+      CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                          HID_REPORT_ITEM_In, &report, &reportSize);
+      if (reportSize == 0)
+        continue;
+      (*reports)++;
+      if (out != NULL)
+      {
+        const uint8_t* bytes = (const uint8_t*)&report;
+        uint16_t b;
+
+        fprintf(out, "%8ld %u:", scans, reportID);
+        for (b = 0; b < reportSize; b++)
+          fprintf(out, " %02x", bytes[b]);
+        fprintf(out, "\n");
+      }
+    }
+  }
+  return scans;
+}
+
+// Reads a trace file; NULL on an error, after saying why.
+static TraceSample* Replay_Load(const char* path, long* count)
+{
+  FILE* in;
+  char magic[4];
+  TraceSample* samples = NULL;
+  long size = 0;
+
+  *count = 0;
+  in = fopen(path, "rb");
+  if (in == NULL)
+  {
+    perror(path);
+    return NULL;
+  }
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+  {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    fclose(in);
+    return NULL;
+  }
+  for (;;)
+  {
+    if (*count == size)
+    {
+      size = size ? 2 * size : 1024;
+      samples = realloc(samples, size * sizeof(TraceSample));
+      if (samples == NULL)
+      {
+        perror("realloc");
+        fclose(in);
+        return NULL;
+      }
+    }
+    if (fread(&samples[*count], sizeof(TraceSample), 1, in) != 1)
+      break;
+    if (samples[*count].Scans == 0)
+    {
+      fprintf(stderr, "%s: sample %ld has no scans\n", path, *count);
+      fclose(in);
+      free(samples);
+      return NULL;
+    }
+    (*count)++;
+  }
+  fclose(in);
+  return samples;
+}
+
+static int Replay(const char* path, long passes, bool raw)
+{
+  TraceSample* samples;
+  long count, scans = 0, reports = 0, p;
+  double t0, t;
+
+  samples = Replay_Load(path, &count);
+  if (samples == NULL)
+    return 2;
+
+  Bench_Init();
+#ifdef RAW_EVENTS
+  if (raw)
+  {
+    RawOut = stdout;
+    Replay_Pass(samples, count, NULL, &reports);
+    free(samples);
+    return 0;
+  }
+#else
+  (void)raw;
+#endif
+  Replay_Pass(samples, count, stdout, &reports);
+
+  reports = 0;
+  t0 = BenchNow();
+  for (p = 0; p < passes; p++)
+    scans += Replay_Pass(samples, count, NULL, &reports);
+  t = BenchNow() - t0;
+  if (t > 0)
+    fprintf(stderr, "replay : %ld samples %12.0f scans/sec %12.0f reports/sec\n",
+            count, scans / t, reports / t);
+  fprintf(stderr, "queue  : %12u max depth %8u overflows\n", EventDepthMax, EventOverflows);
+  free(samples);
+  return 0;
+}
+
+#ifdef SCAN_UNROLLED
+// Reads each trace sample's matrix through Direct_ReadMatrix and through
+// Direct_ReadUnrolled, and fails on any difference in the columns read or
+// in the port left behind. A matrix with a different value in every
+// column is read first, so a wrong column address cannot go unnoticed.
+// Before that, an idle matrix has to take the scan's idle fast path, and
+// leave the idle governor idle, whatever SC_COLUMNS is.
+static bool ScanCheck_Matrix(const uint8_t* matrix, long sample)
+{
+  MatrixState generic, unrolled;
+  uint8_t port;
+
+  memcpy(SimMatrix, matrix, sizeof(SimMatrix));
+  memset(&generic, 0xFF, sizeof(generic));
+  memset(&unrolled, 0xFF, sizeof(unrolled));
+  Direct_ReadMatrix(&generic);
+  port = SimPort;
+  Direct_ReadUnrolled(&unrolled);
+  if (memcmp(&generic, &unrolled, sizeof(generic)) == 0 && port == SimPort)
+    return true;
+  fprintf(stderr, "sample %ld: unrolled scan differs (port %02x, %02x)\n",
+          sample, port, SimPort);
+  return false;
+}
+
+static int ScanCheck(const char* path)
+{
+  TraceSample* samples;
+  uint8_t marked[16];
+  long count, i, failed = 0;
+
+  samples = Replay_Load(path, &count);
+  if (samples == NULL)
+    return 2;
+  Direct_Init();
+  for (i = 0; i < DEBOUNCE_SCANS; i++)
+    Direct_Scan();
+  if (DebounceBusy || Matrix_Differs(&DirectNKeyStates, &DebounceState) ||
+      Matrix_Differs(&DebounceState, &DirectKeyStates))
+  {
+    fprintf(stderr, "idle matrix: scan misses the fast path\n");
+    failed++;
+  }
+  HAL_Init();
+  for (i = 0; i < 16; i++)
+    marked[i] = (uint8_t)~(1 << (i & 7)) ^ (i >> 3);
+  if (!ScanCheck_Matrix(marked, -1))
+    failed++;
+  for (i = 0; i < count; i++)
+    if (!ScanCheck_Matrix(samples[i].Matrix, i))
+      failed++;
+  printf("scancheck: %ld samples, %d columns, %ld differ\n", count, SC_COLUMNS, failed);
+  free(samples);
+  return failed != 0;
+}
+#endif
+
+// "modecheck": changes mode, format and protocol with two keys held and
+// checks that each change first sends an empty report in the format the
+// host last saw, then the keys in the new one. Also checks that a
+// GET_REPORT on the control pipe reads the keys without taking a queued
+// change from the interrupt pipe.
+static uint8_t ModeCheck_Usage[2];      // Of the two keys held.
+static int ModeCheck_Checks, ModeCheck_Failed;
 
-    if (noKeyUps)
-    {
-#define MAP_SPECIAL_SHIFT(u,s)          \
-        if (CurrentShifts & SHIFT(s))   \
-        {                               \
-            KeysDown[NKeysDown++] = u;  \
-        }                               \
+// Number of the held keys' usages in a report.
+static int ModeCheck_Count(const KeyboardReportBuffer_t* report, uint8_t reportID)
+{
+  int k, i, n = 0;
 
-      MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_LOCKING_CAPS_LOCK,CAPS_LOCK);
-    }
-    if (NKeysDown < sizeof(KeysDown))
+  for (k = 0; k < 2; k++)
+  {
+#ifdef NKRO_REPORT
+    if (reportID == NKRO_REPORT_ID)
     {
-      KeysDown[NKeysDown++] = usage;
+      n += (report->NKRO.Bits[ModeCheck_Usage[k] >> 3] >> (ModeCheck_Usage[k] & 7)) & 1;
+      continue;
     }
-    
+#else
+    (void)reportID;
+#endif
+    for (i = 0; i < sizeof(report->Boot.KeyCode); i++)
+      n += report->Boot.KeyCode[i] == ModeCheck_Usage[k];
+  }
+  return n;
+}
 
+// Polls for one report, on the control pipe if control is set, and fails
+// unless it has the given ID and size and holds that many of the keys;
+// an expected size of 0 means nothing is sent, and 0 keys an all-zero
+// report.
+static void ModeCheck_Expect(const char* step, bool control, uint8_t id,
+                             uint16_t size, int keys)
+{
+  static const KeyboardReportBuffer_t zero;
+  KeyboardReportBuffer_t report;
+  uint8_t reportID = control ? id : 0;
+  uint16_t reportSize;
+  bool ok;
+
+  memset(&report, 0, sizeof(report));
+  ControlGetReport = control;
+  CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                      HID_REPORT_ITEM_In, &report, &reportSize);
+  ControlGetReport = false;
+  ok = reportSize == size;
+  if (ok && size != 0)
+    ok = reportID == id &&
+         (keys != 0 ? ModeCheck_Count(&report, reportID) == keys :
+                      memcmp(&report, &zero, reportSize) == 0);
+  ModeCheck_Checks++;
+  if (ok)
+    return;
+  ModeCheck_Failed++;
+  fprintf(stderr, "%s: got ID %u size %u, want ID %u size %u with %d keys\n",
+          step, reportID, reportSize, id, size, keys);
 }
 
-static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport)
+static void ModeCheck_Feature(uint8_t mode, uint8_t format)
 {
-  
-  uint8_t shifts;
-  int i;
+  uint8_t feature[MODE_REPORT_SIZE] = { 1, mode, format };
 
-  // Do not even send shifts; they could be out-of-date until the next key down.
- 
-#define ADD_SHIFT(m,s)          \
-  if (CurrentShifts & SHIFT(s)) \
-    shifts |= m;\
+  CALLBACK_HID_Device_ProcessHIDReport(&Keyboard_HID_Interface, KEYBOARD_REPORT_ID,
+                                       HID_REPORT_ITEM_Feature, feature, sizeof(feature));
+}
 
-  shifts = 0;
+// Scans until the matrix is debounced, polling after every scan if poll
+// is set.
+static void ModeCheck_Scan(bool poll)
+{
+  KeyboardReportBuffer_t report;
+  uint16_t reportSize;
+  uint8_t reportID;
+  int i;
 
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTCTRL,L_CONTROL);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTSHIFT,L_SHIFT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTALT,R_ALT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTGUI,R_GUI);
- ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTSHIFT,R_SHIFT); 
-  KeyboardReport->Modifier = shifts;
+  for (i = 0; i < 4 * DEBOUNCE_SCANS + 4; i++)
+  {
+    Direct_Scan();
+    reportID = 0;
+    if (poll)
+      CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                          HID_REPORT_ITEM_In, &report, &reportSize);
+  }
+}
 
+static int ModeCheck(void)
+{
+  const uint16_t boot = sizeof(USB_KeyboardReport_Data_t);
+  KeyboardReportBuffer_t report;
+  uint16_t reportSize, rollover;
+  uint8_t pos[2], n = 0, p, reportID;
+
+  Bench_Init();
+  Keyboard_HID_Interface.State.UsingReportProtocol = true;
+  for (p = 0; p < 128 && n < 2; p++)    // Two ordinary keys.
+  {
+    KeyEntry entry = KEYMAP_ENTRY(0, p);
+
+    if (KEY_SHIFT(entry) != NONE || KEY_USAGE(entry) == 0 ||
+        KEY_USAGE(entry) >= HID_KEYBOARD_SC_LEFT_CONTROL ||
+        (n == 1 && KEY_USAGE(entry) == ModeCheck_Usage[0]))
+      continue;
+    pos[n] = p;
+    ModeCheck_Usage[n++] = KEY_USAGE(entry);
+  }
+  for (p = 0; p < 2; p++)
+    SimMatrix[pos[p] >> 3] &= ~(1 << (pos[p] & 7));
+  ModeCheck_Scan(true);
+  ModeCheck_Expect("held", true, KEYBOARD_REPORT_ID, boot, 2);
+  ModeCheck_Expect("held, settled", false, 0, 0, 0);
+
+  ModeCheck_Feature(HUT1, REPORT_6KRO);
+  ModeCheck_Expect("mode, release", false, KEYBOARD_REPORT_ID, boot, 0);
+  ModeCheck_Expect("mode, keys", false, KEYBOARD_REPORT_ID, boot, 2);
+  ModeCheck_Expect("mode, settled", false, 0, 0, 0);
+
+#ifdef NKRO_REPORT
+  ModeCheck_Feature(HUT1, REPORT_NKRO);
+  ModeCheck_Expect("nkro, release", false, KEYBOARD_REPORT_ID, boot, 0);
+  ModeCheck_Expect("nkro, keys", false, NKRO_REPORT_ID,
+                   sizeof(USB_KeyboardNKROReport_Data_t), 2);
+  ModeCheck_Expect("nkro, settled", false, 0, 0, 0);
+
+  Keyboard_HID_Interface.State.UsingReportProtocol = false;
+  ModeCheck_Expect("boot protocol, release", false, 0, boot, 0);
+  ModeCheck_Expect("boot protocol, keys", false, 0, boot, 2);
+  Keyboard_HID_Interface.State.UsingReportProtocol = true;
+  ModeCheck_Expect("report protocol, release", false, KEYBOARD_REPORT_ID, boot, 0);
+  ModeCheck_Expect("report protocol, keys", false, NKRO_REPORT_ID,
+                   sizeof(USB_KeyboardNKROReport_Data_t), 2);
+
+  ModeCheck_Feature(HUT1, REPORT_6KRO);
+  ModeCheck_Expect("6kro, release", false, NKRO_REPORT_ID,
+                   sizeof(USB_KeyboardNKROReport_Data_t), 0);
+  ModeCheck_Expect("6kro, keys", false, KEYBOARD_REPORT_ID, boot, 2);
+  ModeCheck_Expect("6kro, settled", false, 0, 0, 0);
+#endif
 
-  if (NKeysDown > sizeof(KeyboardReport->KeyCode))
+  // Release one key but leave the change queued: the control pipe still
+  // sees both keys, and the interrupt pipe then sends the release.
+  SimMatrix[pos[1] >> 3] |= 1 << (pos[1] & 7);
+  ModeCheck_Scan(false);
+  ModeCheck_Expect("control, queued", true, KEYBOARD_REPORT_ID, boot, 2);
+  ModeCheck_Expect("control, again", true, KEYBOARD_REPORT_ID, boot, 2);
+  ModeCheck_Expect("release", false, KEYBOARD_REPORT_ID, boot, 1);
+  ModeCheck_Expect("release, control", true, KEYBOARD_REPORT_ID, boot, 1);
+  ModeCheck_Expect("release, settled", false, 0, 0, 0);
+
+  // Past six keys the boot report rolls over. A send on the interrupt
+  // pipe counts as a rollover report; a control read does not.
+  for (p = 0; p < 128; p++)
+    if (KEY_SHIFT(KEYMAP_ENTRY(0, p)) == NONE && KEY_USAGE(KEYMAP_ENTRY(0, p)) != 0)
+      SimMatrix[p >> 3] &= ~(1 << (p & 7));
+  rollover = RolloverReports;
+  ModeCheck_Scan(true);
+  ModeCheck_Checks++;
+  if (RolloverReports == rollover)
   {
-    for (i = 0; i < sizeof(KeyboardReport->KeyCode); i++)
-    {
-      KeyboardReport->KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
-    }
+    ModeCheck_Failed++;
+    fprintf(stderr, "rollover: send not counted\n");
   }
-  else
+  rollover = RolloverReports;
+  reportID = KEYBOARD_REPORT_ID;
+  ControlGetReport = true;
+  CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                      HID_REPORT_ITEM_In, &report, &reportSize);
+  ControlGetReport = false;
+  ModeCheck_Checks++;
+  if (RolloverReports != rollover || report.Boot.KeyCode[0] != HID_KEYBOARD_SC_ERROR_ROLLOVER)
   {
-    for (i = 0; i < NKeysDown; i++)
-    {
-      KeyboardReport->KeyCode[i] = KeysDown[i];
-    }
+    ModeCheck_Failed++;
+    fprintf(stderr, "rollover, control: counted, or not rolled over\n");
   }
- 
-}
 
+  printf("modecheck: %d checks, %d failed\n", ModeCheck_Checks, ModeCheck_Failed);
+  return ModeCheck_Failed != 0;
+}
 
+#if KEY_CHORDS > 0 || KEY_MACROS > 0
+static int KeyCheck_Checks, KeyCheck_Failed;
 
-static uint8_t Direct_Read(uint8_t column)
+// Presses (down set) or releases the keys at the positions, all in the
+// same scan, and scans until they are debounced without polling.
+static void KeyCheck_Keys(bool down, uint8_t pos0, uint8_t pos1)
 {
-  uint8_t p2;
+  uint8_t pos[2] = { pos0, pos1 };
+  uint8_t i;
 
-  SC_ADDR_PORT = (SC_ADDR_PORT & ~(0x0F << SC_ADDR_SHIFT)) | (column << SC_ADDR_SHIFT);
-  SC_STROBE_PORT &= ~SC_STROBE;
+  for (i = 0; i < 2; i++)
+    if (pos[i] != 0xFF)
+    {
+      if (down)
+        SimMatrix[pos[i] >> 3] &= ~(1 << (pos[i] & 7));
+      else
+        SimMatrix[pos[i] >> 3] |= 1 << (pos[i] & 7);
+    }
+  ModeCheck_Scan(false);
+}
+#endif
 
+#if KEY_MACROS > 0
+// The host's side: the usages down after the last report, and the text
+// typed by the presses in it, in usage order. Plain and shifted keys type
+// their US-layout characters, ENTER a \n, anything else
+// {modifiers:usage} in hex.
+static uint8_t MacroCheck_Down[USAGE_BYTES];
+static char MacroCheck_Text[256];
 
-  _delay_us(5);
+static void MacroCheck_Type(uint8_t mods, uint8_t usage)
+{
+  static const char plain[] = "1234567890\0\0\0\0 -=[]\\\0;'`,./";
+  static const char shifted[] = "!@#$%^&*()\0\0\0\0 _+{}|\0:\"~<>?";
+  size_t length = strlen(MacroCheck_Text);
+  bool shift = (mods & ~(HID_KEYBOARD_MODIFIER_LEFTSHIFT |
+                         HID_KEYBOARD_MODIFIER_RIGHTSHIFT)) == 0;
+  char c = 0;
+
+  if (shift && usage >= HID_KEYBOARD_SC_A && usage <= HID_KEYBOARD_SC_Z)
+    c = (mods ? 'A' : 'a') + usage - HID_KEYBOARD_SC_A;
+  else if (shift && usage >= HID_KEYBOARD_SC_1_AND_EXCLAMATION &&
+           usage - HID_KEYBOARD_SC_1_AND_EXCLAMATION < (int)sizeof(plain) - 1)
+    c = (mods ? shifted : plain)[usage - HID_KEYBOARD_SC_1_AND_EXCLAMATION];
+  if (c != 0)
+    snprintf(MacroCheck_Text + length, sizeof(MacroCheck_Text) - length, "%c", c);
+  else if (usage == HID_KEYBOARD_SC_ENTER && mods == 0)
+    snprintf(MacroCheck_Text + length, sizeof(MacroCheck_Text) - length, "\\n");
+  else
+    snprintf(MacroCheck_Text + length, sizeof(MacroCheck_Text) - length,
+             "{%02X:%02X}", mods, usage);
+}
 
+// Polls the interrupt pipe once and types what the report presses; false
+// if nothing was sent.
+static bool MacroCheck_Poll(void)
+{
+  KeyboardReportBuffer_t report;
+  uint8_t down[USAGE_BYTES], mods, i;
+  uint16_t reportSize;
+  uint8_t reportID = 0;
+
+  memset(&report, 0, sizeof(report));
+  CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                      HID_REPORT_ITEM_In, &report, &reportSize);
+  if (reportSize == 0)
+    return false;
+  memset(down, 0, sizeof(down));
+#ifdef NKRO_REPORT
+  if (reportID == NKRO_REPORT_ID)
+  {
+    mods = report.NKRO.Modifier;
+    memcpy(down, report.NKRO.Bits, sizeof(down) < sizeof(report.NKRO.Bits) ?
+                                   sizeof(down) : sizeof(report.NKRO.Bits));
+  }
+  else
+#endif
+  {
+    mods = report.Boot.Modifier;
+    for (i = 0; i < sizeof(report.Boot.KeyCode); i++)
+      down[report.Boot.KeyCode[i] >> 3] |= 1 << (report.Boot.KeyCode[i] & 7);
+    down[0] &= ~1;              // Usage 0 is no key.
+  }
+  for (i = 1; i < USAGE_LIMIT; i++)
+    if ((down[i >> 3] & ~MacroCheck_Down[i >> 3]) & (1 << (i & 7)))
+      MacroCheck_Type(mods, i);
+  memcpy(MacroCheck_Down, down, sizeof(down));
+  return true;
+}
 
-  p2 = SC_KEYS_PIN;
+// Polls until eight polls in a row send nothing.
+static void MacroCheck_Settle(void)
+{
+  int quiet;
 
-  SC_STROBE_PORT |= SC_STROBE;
-  return p2;
+  for (quiet = 0; quiet < 8; )
+    quiet = MacroCheck_Poll() ? 0 : quiet + 1;
 }
 
-static void Direct_Init(void)
+static void MacroCheck_Expect(const char* step, const char* text, bool active)
 {
-  int i;
+  KeyCheck_Checks++;
+  if (strcmp(MacroCheck_Text, text) == 0 && MacroActive == active)
+    return;
+  KeyCheck_Failed++;
+  fprintf(stderr, "%s: typed \"%s\"%s, want \"%s\"%s\n", step, MacroCheck_Text,
+          MacroActive ? " (playing)" : "", text, active ? " (playing)" : "");
+}
 
-  SC_ADDR_DDR |= (0x0F << SC_ADDR_SHIFT);
-  SC_STROBE_DDR |= SC_STROBE;
-  SC_STROBE_PORT |= SC_STROBE;  // Idle high.
+// Plays host/checkmap.h's macro on 176 through its wait and checks what a
+// host would type, then starts it again and stops it with a key press.
+static void MacroCheck_Run(const char* format)
+{
+  static const char text[] = "abcdefgh Hello, World!\\n{05:4C}";
+  char step[64];
+  size_t typed;
+  uint8_t i;
+
+  MacroCheck_Text[0] = 0;
+  KeyCheck_Keys(true, 0176, 0xFF);
+  KeyCheck_Keys(false, 0176, 0xFF);
+  MacroCheck_Settle();
+  snprintf(step, sizeof(step), "%s, to the wait", format);
+  MacroCheck_Expect(step, text, true);
+  for (i = 0; i < 4; i++)
+    EVENT_USB_Device_StartOfFrame();
+  MacroCheck_Settle();
+  snprintf(step, sizeof(step), "%s, 4 ms into the wait", format);
+  MacroCheck_Expect(step, text, true);
+  EVENT_USB_Device_StartOfFrame();
+  MacroCheck_Settle();
+  snprintf(step, sizeof(step), "%s, played", format);
+  MacroCheck_Expect(step, "abcdefgh Hello, World!\\n{05:4C}zz{0F:3A}", false);
+  KeyCheck_Checks++;
+  for (i = 0; i < USAGE_BYTES && MacroCheck_Down[i] == 0; i++)
+    ;
+  if (i < USAGE_BYTES || CurrentModifiers() != 0)
+  {
+    KeyCheck_Failed++;
+    fprintf(stderr, "%s, played: keys left down\n", format);
+  }
 
-  for (i = 0; i < 16; i++)
-    DirectKeyStates[i] = 1;
- 
+  // Three reports in, a press of 020 (TAB) stops playback.
+  MacroCheck_Text[0] = 0;
+  KeyCheck_Keys(true, 0176, 0xFF);
+  KeyCheck_Keys(false, 0176, 0xFF);
+  for (i = 0; i < 3; i++)
+    MacroCheck_Poll();
+  typed = strlen(MacroCheck_Text);
+  KeyCheck_Keys(true, 020, 0xFF);
+  MacroCheck_Settle();
+  snprintf(step, sizeof(step), "%s, stopped", format);
+  KeyCheck_Checks++;
+  if (MacroActive || typed == 0 || strncmp(MacroCheck_Text, text, typed) != 0 ||
+      strcmp(MacroCheck_Text + typed, "{00:2B}") != 0 ||
+      MacroCheck_Down[HID_KEYBOARD_SC_TAB >> 3] != 1 << (HID_KEYBOARD_SC_TAB & 7))
+  {
+    KeyCheck_Failed++;
+    fprintf(stderr, "%s: typed \"%s\"%s\n", step, MacroCheck_Text,
+            MacroActive ? " (playing)" : "");
+  }
+  KeyCheck_Keys(false, 020, 0xFF);
+  MacroCheck_Settle();
 }
 
-static void Direct_Scan(void)
+// Runs MacroCheck_Run in the boot format, and with -DNKRO_REPORT again in
+// the NKRO one.
+static int MacroCheck(void)
 {
-  int i;
-  int j;
-  
-  for (i = 0; i < 16; i++)
+  if (KEY_MACROS != 1 || KEY_SHIFT(KEYMAP_ENTRY(0, 0176)) != MACRO)
   {
-    DirectNKeyStates[i] = Direct_Read(i);
+    fprintf(stderr, "macrocheck: build with -DKEYMAP='\"host/checkmap.h\"'\n");
+    return 2;
   }
+  Bench_Init();
+  MacroCheck_Run("boot");
+#ifdef NKRO_REPORT
+  Keyboard_HID_Interface.State.UsingReportProtocol = true;
+  ModeCheck_Feature(HUT1, REPORT_NKRO);
+  MacroCheck_Settle();
+  MacroCheck_Run("nkro");
+#endif
+  printf("macrocheck: %d checks, %d failed\n", KeyCheck_Checks, KeyCheck_Failed);
+  return KeyCheck_Failed != 0;
+}
 
-  for (i = 0; i < 16; i++)
+#endif
+
+#if KEY_CHORDS > 0
+// Polls the interrupt pipe, a few times at most, for the next report, and
+// fails unless it has the modifiers and, in order, the usages k0 and k1
+// (0 for none). With quiet set it fails if anything is sent at all.
+static void KeyCheck_Expect(const char* step, bool quiet, uint8_t mods,
+                            uint8_t k0, uint8_t k1)
+{
+  USB_KeyboardReport_Data_t want, report;
+  uint16_t reportSize = 0;
+  uint8_t reportID, n;
+
+  memset(&want, 0, sizeof(want));
+  want.Modifier = mods;
+  want.KeyCode[0] = k0;
+  want.KeyCode[1] = k1;
+  for (n = 0; n < 8 && reportSize == 0; n++)
   {
-      uint8_t keys;
-      uint8_t change;
-      
-    keys =   DirectNKeyStates[i];
-    change = keys ^ DirectKeyStates[i];
+    reportID = 0;
+    memset(&report, 0, sizeof(report));
+    CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                        HID_REPORT_ITEM_In, &report, &reportSize);
+  }
+  KeyCheck_Checks++;
+  if (quiet ? reportSize == 0 :
+              reportSize == sizeof(report) && memcmp(&report, &want, sizeof(report)) == 0)
+    return;
+  KeyCheck_Failed++;
+  fprintf(stderr, "%s: got size %u mods %02x keys %02x %02x, ", step, reportSize,
+          report.Modifier, report.KeyCode[0], report.KeyCode[1]);
+  if (quiet)
+    fprintf(stderr, "want nothing\n");
+  else
+    fprintf(stderr, "want mods %02x keys %02x %02x\n", mods, k0, k1);
+}
 
-    if (change == 0) continue;
-      DirectKeyStates[i] = keys;
+// Runs the chord engine through host/checkmap.h's chords: 015 + 016 for
+// ESCAPE and 005 + 006 for TAB with L_SHIFT; 015 alone is A, 005 L, 020
+// TAB and 114 L_SHIFT.
+static int ChordCheck(void)
+{
+  const uint8_t shift = HID_KEYBOARD_MODIFIER_LEFTSHIFT;
+  const uint8_t a = HID_KEYBOARD_SC_A, esc = HID_KEYBOARD_SC_ESCAPE,
+                tab = HID_KEYBOARD_SC_TAB;
+  uint8_t i;
 
-      for (j = 0; j < 8; j++)
-      {
-          if (change & (1 << j))
-          {
-              int code = (i * 8) + j;
-              if (keys & (1 << j))
-              {
-                  KeyUp(&Keys[code]);
-              }
-              else
-              {
-                  KeyDown(&Keys[code],false);
-             
-              }
-          }
-      }
+  if (KEY_CHORDS != 2 || KEY_USAGE(pgm_read_word(&ChordEntries[0])) != esc ||
+      KEY_SHIFT(pgm_read_word(&ChordEntries[1])) != L_SHIFT)
+  {
+    fprintf(stderr, "chordcheck: build with -DKEYMAP='\"host/checkmap.h\"'\n");
+    return 2;
   }
+  Bench_Init();
+
+  KeyCheck_Keys(true, 015, 016);
+  KeyCheck_Expect("fire", false, 0, esc, 0);
+  KeyCheck_Expect("fire, settled", true, 0, 0, 0);
+  KeyCheck_Keys(false, 015, 0xFF);
+  KeyCheck_Expect("fire, first release", false, 0, 0, 0);
+  KeyCheck_Keys(false, 016, 0xFF);
+  KeyCheck_Expect("fire, second release", true, 0, 0, 0);
+
+  KeyCheck_Keys(true, 015, 0xFF);
+  KeyCheck_Keys(false, 015, 0xFF);
+  KeyCheck_Expect("tap", false, 0, a, 0);
+  KeyCheck_Expect("tap, release", false, 0, 0, 0);
+
+  KeyCheck_Keys(true, 015, 0xFF);
+  KeyCheck_Expect("window", true, 0, 0, 0);
+  for (i = 0; i < CHORD_WINDOW_MS; i++)
+    EVENT_USB_Device_StartOfFrame();
+  KeyCheck_Expect("window, timeout", false, 0, a, 0);
+  KeyCheck_Keys(false, 015, 0xFF);
+  KeyCheck_Expect("window, release", false, 0, 0, 0);
+
+  KeyCheck_Keys(true, 015, 0xFF);
+  KeyCheck_Keys(true, 020, 0xFF);
+  KeyCheck_Expect("other key", false, 0, a, 0);
+  KeyCheck_Expect("other key, pressed", false, 0, a, tab);
+  KeyCheck_Keys(false, 015, 0xFF);
+  KeyCheck_Expect("other key, first release", false, 0, tab, 0);
+  KeyCheck_Keys(false, 020, 0xFF);
+  KeyCheck_Expect("other key, second release", false, 0, 0, 0);
+
+  // A newer chord replaces an older one; only its own keys end it.
+  KeyCheck_Keys(true, 015, 016);
+  KeyCheck_Expect("replace", false, 0, esc, 0);
+  KeyCheck_Keys(true, 005, 006);
+  KeyCheck_Expect("replace, newer", false, shift, tab, 0);
+  KeyCheck_Keys(false, 015, 016);
+  KeyCheck_Expect("replace, older released", true, 0, 0, 0);
+  KeyCheck_Keys(false, 005, 0xFF);
+  KeyCheck_Expect("replace, newer released", false, 0, 0, 0);
+  KeyCheck_Keys(false, 006, 0xFF);
+
+  // The chord's modifier is also held by a key; it outlasts the chord.
+  KeyCheck_Keys(true, 0114, 0xFF);
+  KeyCheck_Expect("shift", false, shift, 0, 0);
+  KeyCheck_Keys(true, 005, 006);
+  KeyCheck_Expect("shift, chord", false, shift, tab, 0);
+  KeyCheck_Keys(false, 005, 006);
+  KeyCheck_Expect("shift, chord released", false, shift, 0, 0);
+  KeyCheck_Keys(false, 0114, 0xFF);
+  KeyCheck_Expect("shift, released", false, 0, 0, 0);
+
+  printf("chordcheck: %d checks, %d failed\n", KeyCheck_Checks, KeyCheck_Failed);
+  return KeyCheck_Failed != 0;
 }
+#endif
 
+#ifdef KEYMAP_EEPROM
+static int RemapCheck_Checks, RemapCheck_Failed;
 
- static void KeyUp(/*PROGMEM*/ const KeyInfo *key)
- {
-  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
-  KeyShift shift = pgm_read_byte(&key->shift);
-  int i;
+static void RemapCheck_Fail(const char* step, const char* why)
+{
+  RemapCheck_Failed++;
+  fprintf(stderr, "%s: %s\n", step, why);
+}
 
-  if (shift != NONE)
+// Sends one keymap SET, then runs Keymap_Task, as the main loop would,
+// until a GET says the EEPROM work is done. Returns the final status.
+static uint8_t RemapCheck_Set(const KeymapReport_t* set)
+{
+  KeymapReport_t get;
+  uint16_t reportSize;
+  uint8_t reportID;
+  long n;
+
+  CALLBACK_HID_Device_ProcessHIDReport(&Keyboard_HID_Interface, KEYMAP_REPORT_ID,
+                                       HID_REPORT_ITEM_Feature, set, sizeof(*set));
+  for (n = 0; n < 16L * sizeof(KeymapSlot); n++)
   {
-    CurrentShifts &= ~SHIFT(shift);
+    reportID = KEYMAP_REPORT_ID;
+    CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                        HID_REPORT_ITEM_Feature, &get, &reportSize);
+    if (!(get.Code & KEYMAP_STATUS_BUSY))
+      return get.Code;
+    Keymap_Task();
   }
+  return get.Code;
+}
 
-  for (i = 0; i < NKeysDown; i++)
+// Polls the interrupt pipe once and fails unless the report holds usage
+// held (if not 0) and not usage gone.
+static void RemapCheck_Expect(const char* step, uint8_t held, uint8_t gone)
+{
+  KeyboardReportBuffer_t report;
+  uint16_t reportSize;
+  uint8_t reportID = 0;
+  bool has[2] = { false, false };
+  uint8_t i;
+
+  memset(&report, 0, sizeof(report));
+  CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                      HID_REPORT_ITEM_In, &report, &reportSize);
+  for (i = 0; i < sizeof(report.Boot.KeyCode); i++)
   {
+    has[0] |= held != 0 && report.Boot.KeyCode[i] == held;
+    has[1] |= report.Boot.KeyCode[i] == gone;
+  }
+  RemapCheck_Checks++;
+  if (reportSize != sizeof(USB_KeyboardReport_Data_t))
+    RemapCheck_Fail(step, "no report");
+  else if (has[0] != (held != 0) || has[1])
+    RemapCheck_Fail(step, "wrong keys");
+}
 
-      if (KeysDown[i] == usage)
-      {
-
-          NKeysDown--;
-          while (i < NKeysDown)
-          {
-              KeysDown[i] = KeysDown[i+1];
-              i++;
-          }
-          break;
-      }
+// Holds an ordinary key, stages the keymap with that key remapped through
+// the Feature report, and commits it: a wrong checksum is refused, the
+// right one swaps the keymap, and the report then drops the key's old
+// usage for its new one, which its release ends. With a LAYER_1 key in
+// the keymap, that is held first and the key is remapped on layer 1.
+static int RemapCheck(void)
+{
+  KeyEntry staged[KEY_LAYERS][128];
+  KeymapReport_t set;
+  uint8_t layer = 0, layerKey = 0xFF, pos = 0, was = 0, now, status;
+  uint16_t check = 0, i;
+
+  Bench_Init();
+#if KEY_LAYERS > 1
+  for (i = 0; i < 128 && layerKey == 0xFF; i++)
+    if (KEY_SHIFT(KEYMAP_ENTRY(0, i)) == LAYER_1)
+      layerKey = i, layer = 1;
+#endif
+  for (i = 0; i < 128 && was == 0; i++)
+  {
+    KeyEntry entry = KEYMAP_ENTRY(layer, i);
 
+    if (i != layerKey && KEY_SHIFT(entry) == NONE && KEY_USAGE(entry) != 0 &&
+        KEY_USAGE(entry) < HID_KEYBOARD_SC_LEFT_CONTROL)
+      pos = i, was = KEY_USAGE(entry);
   }
- }
- 
-int main(void)                     
+  now = was == HID_KEYBOARD_SC_A ? HID_KEYBOARD_SC_B : HID_KEYBOARD_SC_A;
+  if (layerKey != 0xFF)
+  {
+    SimMatrix[layerKey >> 3] &= ~(1 << (layerKey & 7));
+    ModeCheck_Scan(true);
+  }
+  SimMatrix[pos >> 3] &= ~(1 << (pos & 7));
+  ModeCheck_Scan(true);
+
+  memset(&set, 0, sizeof(set));
+  set.Code = KEYMAP_OP_WRITE;
+  set.Layer = layer;
+  set.Position = pos;
+  set.Count = 1;
+  set.Entries[0] = now;
+  status = RemapCheck_Set(&set);
+  RemapCheck_Checks++;
+  if (!(status & KEYMAP_STATUS_STAGED) || (status & KEYMAP_STATUS_REFUSED))
+    RemapCheck_Fail("write", "not staged");
+
+  memcpy(staged, Keymap, sizeof(staged));
+  staged[layer][pos] = now;
+  for (i = 0; i < sizeof(staged); i++)
+    check = Keymap_CheckStep(check, ((const uint8_t*)staged)[i]);
+
+  set.Code = KEYMAP_OP_COMMIT;
+  set.Check = check + 1;
+  status = RemapCheck_Set(&set);
+  RemapCheck_Checks++;
+  if (!(status & KEYMAP_STATUS_REFUSED) || KEYMAP_ENTRY(layer, pos) != was)
+    RemapCheck_Fail("commit, wrong check", "not refused");
+
+  set.Check = check;
+  status = RemapCheck_Set(&set);
+  RemapCheck_Checks++;
+  if ((status & (KEYMAP_STATUS_STAGED | KEYMAP_STATUS_REFUSED)) ||
+      KEYMAP_ENTRY(layer, pos) != now || KeymapCheck != check)
+    RemapCheck_Fail("commit", "not live");
+  RemapCheck_Expect("swap", now, was);
+
+  SimMatrix[pos >> 3] |= 1 << (pos & 7);
+  ModeCheck_Scan(false);
+  RemapCheck_Expect("release", 0, now);
+
+  printf("remapcheck: %d checks, %d failed\n", RemapCheck_Checks, RemapCheck_Failed);
+  return RemapCheck_Failed != 0;
+}
+#endif
+
+int main(int argc, char** argv)
 {
+  KeyboardReportBuffer_t report;
+  uint16_t reportSize;
+  uint8_t reportID = 0;
+  long i, events;
+  double t0, t;
+
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+    return Replay(argv[2], argc > 3 ? atol(argv[3]) : 100, false);
+#ifdef RAW_EVENTS
+  if (argc == 3 && strcmp(argv[1], "rawevents") == 0)
+    return Replay(argv[2], 0, true);
+#endif
+#ifdef SCAN_UNROLLED
+  if (argc == 3 && strcmp(argv[1], "scancheck") == 0)
+    return ScanCheck(argv[2]);
+#endif
+  if (argc == 2 && strcmp(argv[1], "modecheck") == 0)
+    return ModeCheck();
+#ifdef KEYMAP_EEPROM
+  if (argc == 2 && strcmp(argv[1], "remapcheck") == 0)
+    return RemapCheck();
+#endif
+#if KEY_CHORDS > 0
+  if (argc == 2 && strcmp(argv[1], "chordcheck") == 0)
+    return ChordCheck();
+#endif
+#if KEY_MACROS > 0
+  if (argc == 2 && strcmp(argv[1], "macrocheck") == 0)
+    return MacroCheck();
+#endif
 
-      
-     
-      SetupHardware();   
-      GlobalInterruptEnable();
-    
+  Bench_Init();
 
-  while(true)
+  // Idle: nothing changes between scans.
+  t0 = BenchNow();
+  for (i = 0; i < BENCH_SCANS; i++)
+    Direct_Scan();
+  t = BenchNow() - t0;
+  printf("idle   : %12.0f scans/sec\n", BENCH_SCANS / t);
+
+  // Busy: press or release one key every DEBOUNCE_SCANS scans.
+  events = 0;
+  t0 = BenchNow();
+  for (i = 0; i < BENCH_SCANS; i++)
   {
+    if (i % DEBOUNCE_SCANS == 0)
+    {
+      uint8_t code = (i / (2 * DEBOUNCE_SCANS)) & 0x7F;
+      SimMatrix[code >> 3] ^= (1 << (code & 7));
+    }
     Direct_Scan();
-    HID_Device_USBTask(&Keyboard_HID_Interface);
-    USB_USBTask();
+    events += (uint8_t)(EventHead - EventTail);
+    KeyEvent_Drain();
   }
+  t = BenchNow() - t0;
+  printf("active : %12.0f scans/sec %12.0f events/sec\n", BENCH_SCANS / t, events / t);
+  printf("scan   : %12lu ns min %8lu ns max\n",
+         (unsigned long)ScanTicksMin * HAL_TICK_NS, (unsigned long)ScanTicksMax * HAL_TICK_NS);
+
+  // Report builder with a few keys held, unchanged and changed every call.
+  SimMatrix[0] &= ~0x07;
+  for (i = 0; i < DEBOUNCE_SCANS; i++)
+    Direct_Scan();
+  t0 = BenchNow();
+  for (i = 0; i < BENCH_REPORTS; i++)
+  {
+    memset(&report, 0, sizeof(report));
+    CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                        HID_REPORT_ITEM_In, &report, &reportSize);
+  }
+  t = BenchNow() - t0;
+  printf("report : %12.1f ns/CreateHIDReport (unchanged)\n", t * 1e9 / BENCH_REPORTS);
 
+  t0 = BenchNow();
+  for (i = 0; i < BENCH_REPORTS; i++)
+  {
+    KeyStateGeneration++;
+    memset(&report, 0, sizeof(report));
+    CALLBACK_HID_Device_CreateHIDReport(&Keyboard_HID_Interface, &reportID,
+                                        HID_REPORT_ITEM_In, &report, &reportSize);
+  }
+  t = BenchNow() - t0;
+  printf("report : %12.1f ns/CreateHIDReport (changed)\n", t * 1e9 / BENCH_REPORTS);
+  printf("queue  : %12u max depth %8u overflows\n", EventDepthMax, EventOverflows);
+#ifdef LATENCY_STATS
+  printf("period : %12lu ns min %8lu ns avg %8lu ns max\n",
+         (unsigned long)ScanPeriodMin * HAL_TICK_NS,
+         (unsigned long)(ScanPeriodCount > 1 ? ScanPeriodSum / (ScanPeriodCount - 1) : 0) * HAL_TICK_NS,
+         (unsigned long)ScanPeriodMax * HAL_TICK_NS);
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    printf("latency: < %8lu ns %10u\n",
+           (unsigned long)((i + 1) << LATENCY_BUCKET_SHIFT) * HAL_TICK_NS, LatencyHist[i]);
+#endif
 
-
+  return 0;
 }
+#endif
 
 
 /* Configures the board hardware and keyboard pins. */
@@ -503,10 +3436,23 @@ int main(void)
 #endif
 
   /* Hardware Initialization */
-        
+#if defined(FAST_BOOT) && !defined(SIM_BUILD)
+  // Attach first, so the host's attach debounce and reset overlap the
+  // matrix setup; enumeration proceeds once interrupts are enabled.
+  USB_Init();
+#endif
+
+#ifdef KEYMAP_EEPROM
+  Keymap_Init();
+#endif
   Direct_Init();
+#ifdef SCAN_TIMER
+  Scan_TimerInit();
+#endif
 
+#if !defined(FAST_BOOT) && !defined(SIM_BUILD)
   USB_Init();
+#endif
 }
 
 
@@ -516,23 +3462,154 @@ void EVENT_USB_Device_ConfigurationChanged(void)
   bool ConfigSuccess = true;
 
   ConfigSuccess &= HID_Device_ConfigureEndpoints(&Keyboard_HID_Interface);
+#ifdef RAW_EVENTS
+  ConfigSuccess &= HID_Device_ConfigureEndpoints(&RawEvents_HID_Interface);
+#endif
 
   USB_Device_EnableSOFEvents();
 
+  // Send the current state on the first poll, held keys included, rather
+  // than waiting for the next change.
+  Boot_Configured();
+  ReportedGeneration = KeyStateGeneration - 1;
+
 //  LEDs_SetAllLEDs(ConfigSuccess ? LEDMASK_USB_READY : LEDMASK_USB_ERROR);
 }
 
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
+  ControlGetReport = (USB_ControlRequest.bRequest == HID_REQ_GetReport);
   HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
+#ifdef RAW_EVENTS
+  HID_Device_ProcessControlRequest(&RawEvents_HID_Interface);
+#endif
+  ControlGetReport = false;
 }
 
 /** Event handler for the USB device Start Of Frame event. */
 void EVENT_USB_Device_StartOfFrame(void)
 {
   HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
+#ifdef RAW_EVENTS
+  HID_Device_MillisecondElapsed(&RawEvents_HID_Interface);
+#endif
+  FrameClock++;
+
+  if (++SofCount == 1000)
+  {
+    SofCount = 0;
+    ScansPerSec = ScanCount - ScanCountMark;
+    ScanCountMark = ScanCount;
+  }
+#if defined(SCAN_TIMER) && defined(SCAN_SOF_LOCK)
+  TCNT0 = SCAN_TIMER_TOP - SCAN_SOF_DELAY;
+#endif
+#ifdef IDLE_GOVERNOR
+  if (ScanActivity)
+  {
+    ScanActivity = false;
+    IdleMs = 0;
+  }
+  else if (IdleMs < IDLE_AFTER_MS)
+    IdleMs++;
+  else
+  {
+    static uint8_t idleScanMs;
+
+    ScanIdle = true;
+    if (++idleScanMs >= IDLE_SCAN_MS)
+    {
+      idleScanMs = 0;
+      IdleScanDue = true;
+    }
+  }
+#endif
+}
+
+#ifdef IDLE_GOVERNOR
+/** Event handler for the USB device suspend event. */
+void EVENT_USB_Device_Suspend(void)
+{
+  UsbSuspended = true;
+}
+
+/** Event handler for the USB device wake up event. */
+void EVENT_USB_Device_WakeUp(void)
+{
+  UsbSuspended = false;
+}
+#endif
+
+static void Telemetry_Fill(TelemetryReport_t* Telemetry)
+{
+#ifdef SCAN_TIMER
+  // The scan ISR updates most of these; copy them in one piece.
+  uint8_t CurrentGlobalInt = GetGlobalInterruptMask();
+  GlobalInterruptDisable();
+#endif
+
+  Telemetry->Version            = TELEMETRY_VERSION;
+  Telemetry->ScansPerSec        = ScansPerSec;
+  Telemetry->PressEvents        = PressEvents;
+  Telemetry->ReleaseEvents      = ReleaseEvents;
+  Telemetry->DebounceSuppressed = DebounceSuppressed;
+  Telemetry->RolloverReports    = RolloverReports;
+  Telemetry->EventOverflows     = EventOverflows;
+  memcpy(Telemetry->ColumnChatter, ColumnChatter, sizeof(ColumnChatter));
+#ifdef LATENCY_STATS
+  Telemetry->Flags |= TELEMETRY_FLAG_LATENCY;
+  memcpy(Telemetry->LatencyHist, LatencyHist, sizeof(LatencyHist));
+#endif
+  if (BootReported)
+    Telemetry->Flags |= TELEMETRY_FLAG_BOOT;
+  Telemetry->BootConfiguredUs   = BootConfiguredUs;
+  Telemetry->BootReportUs       = BootReportUs;
+
+#ifdef SCAN_TIMER
+  SetGlobalInterruptMask(CurrentGlobalInt);
+#endif
+}
+
+#ifdef TRACE_RECORD
+static void Trace_Arm(bool on)
+{
+#ifdef SCAN_TIMER
+  uint8_t CurrentGlobalInt = GetGlobalInterruptMask();
+  GlobalInterruptDisable();
+#endif
+
+  if (on)
+  {
+    TraceHead = TraceTail = 0;
+    TraceScans = 0;
+    TraceFlags = TRACE_FLAG_ARMED | TRACE_FLAG_START;
+  }
+  else
+    TraceFlags &= ~(TRACE_FLAG_ARMED | TRACE_FLAG_START);
+
+#ifdef SCAN_TIMER
+  SetGlobalInterruptMask(CurrentGlobalInt);
+#endif
+}
+
+// Only this advances TraceTail, so it needs no lock against the scanner.
+static void Trace_Pop(TraceReport_t* Trace)
+{
+  uint8_t count = TraceHead - TraceTail;
+
+  Trace->Count = count;
+  Trace->Flags = TraceFlags & (TRACE_FLAG_ARMED | TRACE_FLAG_FULL);
+  if (count)
+  {
+    Trace->Sample = TraceRing[TraceTail & (TRACE_DEPTH - 1)];
+    RING_BARRIER();
+    TraceTail++;
+  }
+  else
+    memset(&Trace->Sample, 0, sizeof(Trace->Sample));
 }
+#endif
 
 /** HID class driver callback function for the creation of HID reports to the host.
  *
@@ -553,28 +3630,168 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
 {
   int i;
 
+#ifdef RAW_EVENTS
+  if (HIDInterfaceInfo == &RawEvents_HID_Interface) {
+    if (ReportType == HID_REPORT_ITEM_In && ControlGetReport) {
+      // Events only leave through the interrupt pipe, so the stream
+      // stays in order; a control read gets an empty report.
+      RawEventsReport_t* Report = (RawEventsReport_t*)ReportData;
+
+      memset(Report, 0, sizeof(RawEventsReport_t));
+      Report->Version  = RAW_EVENTS_VERSION;
+      Report->Sequence = RawSequence;
+      *ReportSize = sizeof(RawEventsReport_t);
+      return true;
+    }
+    if (ReportType == HID_REPORT_ITEM_In &&
+        RawEvents_Fill((RawEventsReport_t*)ReportData)) {
+      *ReportSize = sizeof(RawEventsReport_t);
+      return true;
+    }
+    *ReportSize = 0;
+    return false;
+  }
+#endif
+
   switch (ReportType) {
   case HID_REPORT_ITEM_In:
     {
       USB_KeyboardReport_Data_t* KeyboardReport = (USB_KeyboardReport_Data_t*)ReportData;
+      bool idle = HIDInterfaceInfo->State.IdleCount &&
+                  !HIDInterfaceInfo->State.IdleMSRemaining;
+
+      if (ControlGetReport) {
+        // GET_REPORT(Input): the keys as they stand, in the format asked
+        // for. Nothing is applied or stepped and nothing counts as sent,
+        // so the interrupt pipe still reports every change itself.
+#ifdef NKRO_REPORT
+        if (*ReportID == NKRO_REPORT_ID) {
+          AddNKROReport((USB_KeyboardNKROReport_Data_t*)ReportData);
+          *ReportSize = sizeof(USB_KeyboardNKROReport_Data_t);
+          return true;
+        }
+#endif
+        AddKeyReport(KeyboardReport);
+        *ReportSize = sizeof(USB_KeyboardReport_Data_t);
+        return true;
+      }
+#ifdef NKRO_REPORT
+      bool nkro = (CurrentFormat == REPORT_NKRO) &&
+                  HIDInterfaceInfo->State.UsingReportProtocol;
+
+      if (nkro != ReportedNKRO)
+        NeedEmptyReport = true;   // Format or protocol changed.
+#endif
+      {
+        uint16_t generation = KeyStateGeneration;
+
+        // One source of change per report: a chord step, else queued
+        // events, else a macro step, else a repeat.
+#if KEY_CHORDS > 0
+        Chord_Poll();
+        if (generation == KeyStateGeneration)
+#endif
+        KeyEvent_Apply();
+#if KEY_MACROS > 0
+        if (generation == KeyStateGeneration)
+        {
+          uint8_t others = NKeysDown - MacroDownCount;
+          uint8_t room = sizeof(KeyboardReport->KeyCode) > others ?
+                         sizeof(KeyboardReport->KeyCode) - others : 1;
+#ifdef NKRO_REPORT
+          if (nkro)
+            room = MACRO_BATCH_MAX;
+#endif
+          Macro_Poll(room);
+        }
+#endif
+#ifdef TYPEMATIC
+        if (generation == KeyStateGeneration)
+          Repeat_Poll();
+#endif
+        (void)generation;
+      }
+
       if (NeedEmptyReport) {
+        // Release everything, in the format the host last saw, so nothing
+        // stays stuck across a mode change. The buffer is already zeroed.
+        // The live state follows on the next poll. A host that has just
+        // gone to boot protocol only reads the boot layout.
         NeedEmptyReport = false;
+        ReportedGeneration = KeyStateGeneration - 1;
+#ifdef NKRO_REPORT
+        {
+          bool was = ReportedNKRO;
+          ReportedNKRO = nkro;
+          nkro = was && HIDInterfaceInfo->State.UsingReportProtocol;
+        }
+#endif
+      }
+      else if (KeyStateGeneration == ReportedGeneration && !idle) {
+        *ReportSize = 0;          // Unchanged; nothing to send.
+        return false;
       }
      
       else {
+        ReportedGeneration = KeyStateGeneration;
+#ifdef NKRO_REPORT
+        if (nkro)
+          AddNKROReport((USB_KeyboardNKROReport_Data_t*)ReportData);
+        else
+#endif
         AddKeyReport(KeyboardReport);
       }
+      if (!BootReported)
+        Boot_Reported();
+#ifdef NKRO_REPORT
+      if (nkro) {
+        *ReportID = NKRO_REPORT_ID;
+        *ReportSize = sizeof(USB_KeyboardNKROReport_Data_t);
+        return true;
+      }
+#endif
+      // In report protocol every report carries an ID; see hidreports.h.
+      if (HIDInterfaceInfo->State.UsingReportProtocol)
+        *ReportID = KEYBOARD_REPORT_ID;
       *ReportSize = sizeof(USB_KeyboardReport_Data_t);
     }
-    return false;
+    return true;
   case HID_REPORT_ITEM_Feature:
+    if (*ReportID == TELEMETRY_REPORT_ID) {
+      Telemetry_Fill((TelemetryReport_t*)ReportData);
+      *ReportSize = sizeof(TelemetryReport_t);
+      return true;
+    }
+#ifdef SETTLE_CALIBRATE
+    if (*ReportID == SETTLE_REPORT_ID) {
+      memcpy(ReportData, &ColumnSettle, sizeof(ColumnSettle));
+      *ReportSize = sizeof(ColumnSettle);
+      return true;
+    }
+#endif
+#ifdef TRACE_RECORD
+    if (*ReportID == TRACE_REPORT_ID) {
+      Trace_Pop((TraceReport_t*)ReportData);
+      *ReportSize = sizeof(TraceReport_t);
+      return true;
+    }
+#endif
+#ifdef KEYMAP_EEPROM
+    if (*ReportID == KEYMAP_REPORT_ID) {
+      Keymap_Fill((KeymapReport_t*)ReportData);
+      *ReportSize = sizeof(KeymapReport_t);
+      return true;
+    }
+#endif
     {
+      // The mode report, KEYBOARD_REPORT_ID.
       uint8_t* FeatureReport = (uint8_t*)ReportData;
       FeatureReport[0] = (uint8_t)1;
       for (i = 0; i < 1; i++) {
         FeatureReport[i+1] = (uint8_t)CurrentModes[i];
       }
-      *ReportSize = 3;
+      FeatureReport[2] = (uint8_t)CurrentFormat;
+      *ReportSize = MODE_REPORT_SIZE;
     }
     return true;
   default:
@@ -601,6 +3818,11 @@ void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDI
 {
   int i;
 
+#ifdef RAW_EVENTS
+  if (HIDInterfaceInfo == &RawEvents_HID_Interface)
+    return;                     // Input only.
+#endif
+
   switch (ReportType) {
   case HID_REPORT_ITEM_Out:
     if (ReportSize > 0) {
@@ -622,12 +3844,44 @@ void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDI
       }
       break;
   case HID_REPORT_ITEM_Feature:
+    if (ReportID == TELEMETRY_REPORT_ID)
+      break;                    // Read-only.
+#ifdef SETTLE_CALIBRATE
+    if (ReportID == SETTLE_REPORT_ID) {
+      SettleCalibrateRequested = true;  // Run from the main loop.
+      break;
+    }
+#endif
+#ifdef TRACE_RECORD
+    if (ReportID == TRACE_REPORT_ID) {
+      if (ReportSize > 0)
+        Trace_Arm(((const uint8_t*)ReportData)[0] != 0);
+      break;
+    }
+#endif
+#ifdef KEYMAP_EEPROM
+    if (ReportID == KEYMAP_REPORT_ID) {
+      Keymap_Request((const KeymapReport_t*)ReportData, ReportSize);
+      break;
+    }
+#endif
     if (ReportSize > 1) {
       uint8_t* FeatureReport = (uint8_t*)ReportData;
       for (i = 0; i < 1; i++) {
+        if (CurrentModes[i] != (TranslationMode)FeatureReport[i+1])
+          NeedEmptyReport = true;
         CurrentModes[i] = (TranslationMode)FeatureReport[i+1];
       }
+      BaseLayer = (CurrentModes[0] >= HUT1 && CurrentModes[0] - HUT1 < KEY_LAYERS) ?
+                  CurrentModes[0] - HUT1 : 0;
+      Layer_Update();
     }
+#ifdef NKRO_REPORT
+    if (ReportSize > 2) {
+      const uint8_t* FeatureReport = (const uint8_t*)ReportData;
+      CurrentFormat = (FeatureReport[2] == REPORT_NKRO) ? REPORT_NKRO : REPORT_6KRO;
+    }
+#endif
     break;
   }
 }
@@ -0,0 +1,748 @@
+/* ========================================================================
+   $File: keymapgen $
+   $Notice: Host tool; compiles keymap files into the packed Keys[] table. $
+   ======================================================================== */
+
+/*
+  Usage: keymapgen keymap.txt [layer1.txt [layer2.txt [layer3.txt]]] > keymap.h
+
+  Each non-comment line of a keymap is
+
+    <position> <usage> <shift> [repeat] [# comment]
+
+  where position is octal (000..177), usage is a HID_KEYBOARD_SC_ suffix
+  or NONE, and shift is a KeyShift name or - for none. The repeat flag
+  marks a plain key for typematic repeat (-DTYPEMATIC). The first file is
+  layer 0 and must give every position exactly once. Each further file is
+  the next layer; it gives a position at most once, and any it leaves out
+  are copied from layer 0, so the firmware never has to fall through. A
+  LAYER_n shift must name a layer that exists.
+
+  The first file may also hold chords, one per line:
+
+    chord <position> <position> [<position> [<position>]] <usage> <shift>
+
+  Pressing all the positions within the firmware's chord window sends the
+  usage, with the shift if one is given, in place of the keys. The shift
+  may only be a modifier. A chord has two to four distinct positions, no
+  two chords have the same positions, and there are at most eight. They
+  apply on every layer.
+
+  It may also hold macros:
+
+    macro <name> <item> [<item> ...]
+
+  where an item is a "string" (US layout, with \n, \t, \\ and \" escapes),
+  a key tap in braces, {DELETE} or {L_CONTROL+L_ALT+DELETE} or {L_GUI},
+  naming each modifier once (L_META is L_ALT, L_SUPER is L_GUI), or a
+  pause, {wait <ms>} with ms 1..255. Further lines with the same name
+  carry on the macro they follow. A keymap entry plays a macro when its
+  usage is the macro's name and its shift is MACRO. Tapped keys must have
+  usages below 0x80.
+
+  Any error is reported with its line number and the tool exits non-zero
+  without writing a table.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 128
+#define MAX_LAYERS 4
+#define MAX_CHORDS 8            // Bits in the firmware's ChordMask entries.
+#define MAX_CHORD_KEYS 4
+#define MAX_MACROS 64
+#define MAX_MACRO_STEPS 4096    // All macros together.
+#define MAX_LINE 1024
+
+typedef struct
+{
+  int line;
+  char usage[64];
+  char shift[32];
+  int repeat;
+  char comment[96];
+} Entry;
+
+static Entry Entries[MAX_LAYERS][NKEYS];
+static int NLayers;
+
+typedef struct
+{
+  int line;
+  int npos;
+  int pos[MAX_CHORD_KEYS];
+  char usage[64];
+  char shift[32];
+  char comment[96];
+} Chord;
+
+static Chord Chords[MAX_CHORDS];
+static int NChords;
+
+typedef struct
+{
+  char code[160];               // Initializer text, with its trailing comma.
+  char text[48];                // What it types, for the comment.
+  int bytes;
+} Step;
+
+typedef struct
+{
+  int line;
+  char name[32];
+  int first, nsteps;            // In Steps[].
+  int offset;                   // In the firmware's MacroSteps[].
+} Macro;
+
+static Step Steps[MAX_MACRO_STEPS];
+static int NSteps;
+static Macro Macros[MAX_MACROS];
+static int NMacros;
+
+// KeyShift names for the modifiers, and their bits in a HID report.
+static const struct
+{
+  const char *name;
+  unsigned bit;
+} Modifiers[] =
+{
+  { "L_SHIFT", 0x02 }, { "R_SHIFT", 0x20 },
+  { "L_CONTROL", 0x01 }, { "R_CONTROL", 0x10 },
+  { "L_META", 0x04 }, { "R_META", 0x40 },
+  { "L_SUPER", 0x08 }, { "R_SUPER", 0x80 },
+  { "L_ALT", 0x04 }, { "R_ALT", 0x40 },
+  { "L_GUI", 0x08 }, { "R_GUI", 0x80 },
+};
+#define NMODIFIERS ((int)(sizeof(Modifiers) / sizeof(Modifiers[0])))
+
+// Characters a macro string can type, on a US layout: the key, and the
+// character it gives with shift. Letters are handled apart.
+static const struct
+{
+  char plain, shifted;
+  const char *usage;
+} Characters[] =
+{
+  { '1', '!', "1_AND_EXCLAMATION" }, { '2', '@', "2_AND_AT" },
+  { '3', '#', "3_AND_HASHMARK" }, { '4', '$', "4_AND_DOLLAR" },
+  { '5', '%', "5_AND_PERCENTAGE" }, { '6', '^', "6_AND_CARET" },
+  { '7', '&', "7_AND_AMPERSAND" }, { '8', '*', "8_AND_ASTERISK" },
+  { '9', '(', "9_AND_OPENING_PARENTHESIS" }, { '0', ')', "0_AND_CLOSING_PARENTHESIS" },
+  { '\n', 0, "ENTER" }, { '\t', 0, "TAB" }, { ' ', 0, "SPACE" },
+  { '-', '_', "MINUS_AND_UNDERSCORE" }, { '=', '+', "EQUAL_AND_PLUS" },
+  { '[', '{', "OPENING_BRACKET_AND_OPENING_BRACE" },
+  { ']', '}', "CLOSING_BRACKET_AND_CLOSING_BRACE" },
+  { '\\', '|', "BACKSLASH_AND_PIPE" }, { ';', ':', "SEMICOLON_AND_COLON" },
+  { '\'', '"', "APOSTROPHE_AND_QUOTE" }, { '`', '~', "GRAVE_ACCENT_AND_TILDE" },
+  { ',', '<', "COMMA_AND_LESS_THAN_SIGN" }, { '.', '>', "DOT_AND_GREATER_THAN_SIGN" },
+  { '/', '?', "SLASH_AND_QUESTION_MARK" },
+};
+
+static int ParsePosition(const char *text)
+{
+  char *end;
+  long pos = strtol(text, &end, 8);
+
+  if (*end != '\0' || end == text || pos < 0 || pos >= NKEYS)
+    return -1;
+  return (int)pos;
+}
+
+static int SamePositions(const Chord *a, const Chord *b)
+{
+  int i, j;
+
+  if (a->npos != b->npos)
+    return 0;
+  for (i = 0; i < a->npos; i++)
+  {
+    for (j = 0; j < b->npos; j++)
+      if (a->pos[i] == b->pos[j])
+        break;
+    if (j == b->npos)
+      return 0;
+  }
+  return 1;
+}
+
+// Parses the rest of a chord line (after "chord"); returns 1 on an error.
+static int ReadChord(const char *path, int lineno, char *args, const char *comment)
+{
+  char *tokens[MAX_CHORD_KEYS + 3];
+  int ntokens = 0, i, j;
+  Chord *c;
+  char *t;
+
+  for (t = strtok(args, " \t\r\n"); t != NULL; t = strtok(NULL, " \t\r\n"))
+  {
+    if (ntokens == MAX_CHORD_KEYS + 2)
+    {
+      ntokens++;
+      break;
+    }
+    tokens[ntokens++] = t;
+  }
+  if (ntokens < 4 || ntokens > MAX_CHORD_KEYS + 2)
+  {
+    fprintf(stderr, "%s:%d: expected chord <position> <position> [<position> [<position>]] <usage> <shift>\n",
+            path, lineno);
+    return 1;
+  }
+  if (NChords == MAX_CHORDS)
+  {
+    fprintf(stderr, "%s:%d: more than %d chords\n", path, lineno, MAX_CHORDS);
+    return 1;
+  }
+
+  c = &Chords[NChords];
+  memset(c, 0, sizeof(*c));
+  c->npos = ntokens - 2;
+  for (i = 0; i < c->npos; i++)
+  {
+    c->pos[i] = ParsePosition(tokens[i]);
+    if (c->pos[i] < 0)
+    {
+      fprintf(stderr, "%s:%d: bad position '%s' (octal 000..177)\n", path, lineno, tokens[i]);
+      return 1;
+    }
+    for (j = 0; j < i; j++)
+      if (c->pos[j] == c->pos[i])
+      {
+        fprintf(stderr, "%s:%d: position %03o given twice\n", path, lineno, c->pos[i]);
+        return 1;
+      }
+  }
+  snprintf(c->usage, sizeof(c->usage), "%s", tokens[ntokens - 2]);
+  snprintf(c->shift, sizeof(c->shift), "%s", tokens[ntokens - 1]);
+  if (strcmp(c->shift, "-") != 0)
+  {
+    for (i = 0; i < NMODIFIERS; i++)
+      if (strcmp(c->shift, Modifiers[i].name) == 0)
+        break;
+    if (i == NMODIFIERS)
+    {
+      fprintf(stderr, "%s:%d: a chord's shift must be - or a modifier\n", path, lineno);
+      return 1;
+    }
+  }
+  for (i = 0; i < NChords; i++)
+    if (SamePositions(&Chords[i], c))
+    {
+      fprintf(stderr, "%s:%d: same positions as the chord on line %d\n",
+              path, lineno, Chords[i].line);
+      return 1;
+    }
+
+  c->line = lineno;
+  if (comment != NULL)
+    snprintf(c->comment, sizeof(c->comment), "%s", comment);
+  NChords++;
+  return 0;
+}
+
+static int AddStep(const char *path, int lineno, const char *code, const char *text, int bytes)
+{
+  Step *step;
+
+  if (NSteps == MAX_MACRO_STEPS)
+  {
+    fprintf(stderr, "%s:%d: more than %d macro steps\n", path, lineno, MAX_MACRO_STEPS);
+    return 1;
+  }
+  step = &Steps[NSteps++];
+  snprintf(step->code, sizeof(step->code), "%s", code);
+  snprintf(step->text, sizeof(step->text), "%s", text);
+  step->bytes = bytes;
+  return 0;
+}
+
+static int AddCharacter(const char *path, int lineno, char c)
+{
+  char code[96], text[8];
+  const char *usage = NULL;
+  char letter[2] = { 0, 0 };
+  int shifted = 0, i;
+
+  if (c >= 'a' && c <= 'z')
+    usage = letter, letter[0] = (char)(c - 'a' + 'A');
+  else if (c >= 'A' && c <= 'Z')
+    usage = letter, letter[0] = c, shifted = 1;
+  for (i = 0; usage == NULL && i < (int)(sizeof(Characters) / sizeof(Characters[0])); i++)
+  {
+    if (c == Characters[i].plain)
+      usage = Characters[i].usage;
+    else if (c == Characters[i].shifted && c != 0)
+      usage = Characters[i].usage, shifted = 1;
+  }
+  if (usage == NULL)
+  {
+    fprintf(stderr, "%s:%d: cannot type character 0x%02x\n", path, lineno, (unsigned char)c);
+    return 1;
+  }
+  snprintf(code, sizeof(code), "%s(HID_KEYBOARD_SC_%s),",
+           shifted ? "MACRO_SHIFTED" : "MACRO_KEY", usage);
+  if (c == '\n')
+    strcpy(text, "\\n");
+  else if (c == '\t')
+    strcpy(text, "\\t");
+  else if (c == '\\')
+    strcpy(text, "'\\\\'");         // A lone '\' would continue the comment.
+  else
+    snprintf(text, sizeof(text), "'%c'", c);
+  return AddStep(path, lineno, code, text, 1);
+}
+
+// A braced item, without its braces: {wait ms}, or a key tap with any
+// modifiers, MOD+MOD+KEY, or the modifiers alone.
+static int AddBraced(const char *path, int lineno, char *item)
+{
+  char code[160], text[48];
+  const char *key = NULL;
+  unsigned mods = 0;
+  char *t;
+  int ms, i;
+
+  snprintf(text, sizeof(text), "{%s}", item);
+  if (sscanf(item, " wait %d", &ms) == 1)
+  {
+    if (ms < 1 || ms > 255)
+    {
+      fprintf(stderr, "%s:%d: wait must be 1..255 ms\n", path, lineno);
+      return 1;
+    }
+    snprintf(code, sizeof(code), "MACRO_WAIT, %d,", ms);
+    return AddStep(path, lineno, code, text, 2);
+  }
+
+  for (t = strtok(item, "+ \t"); t != NULL; t = strtok(NULL, "+ \t"))
+  {
+    if (key != NULL)
+    {
+      fprintf(stderr, "%s:%d: only the last name in %s may be a key\n", path, lineno, text);
+      return 1;
+    }
+    for (i = 0; i < NMODIFIERS; i++)
+      if (strcmp(t, Modifiers[i].name) == 0)
+        break;
+    if (i == NMODIFIERS)
+    {
+      key = t;
+      continue;
+    }
+    if (mods & Modifiers[i].bit)
+    {
+      fprintf(stderr, "%s:%d: %s names a modifier twice\n", path, lineno, text);
+      return 1;
+    }
+    mods |= Modifiers[i].bit;
+  }
+  if (key == NULL && mods == 0)
+  {
+    fprintf(stderr, "%s:%d: empty {}\n", path, lineno);
+    return 1;
+  }
+  if (key == NULL)
+  {
+    snprintf(code, sizeof(code), "MACRO_MODS_TAP, 0x%02X,", mods);
+    return AddStep(path, lineno, code, text, 2);
+  }
+  if (mods == 0)
+  {
+    snprintf(code, sizeof(code), "MACRO_KEY(HID_KEYBOARD_SC_%s),", key);
+    return AddStep(path, lineno, code, text, 1);
+  }
+  snprintf(code, sizeof(code), "MACRO_MODS, 0x%02X, MACRO_KEY(HID_KEYBOARD_SC_%s),", mods, key);
+  return AddStep(path, lineno, code, text, 3);
+}
+
+// Parses the rest of a macro line (after "macro"), comment included;
+// returns the number of errors.
+static int ReadMacro(const char *path, int lineno, char *args)
+{
+  char name[32];
+  char *p = args;
+  Macro *m;
+  int n, i, errors = 0;
+
+  if (sscanf(p, "%31s%n", name, &n) != 1 || name[0] == '"' || name[0] == '{' ||
+      name[0] == '#')
+  {
+    fprintf(stderr, "%s:%d: expected macro <name> <item> ...\n", path, lineno);
+    return 1;
+  }
+  p += n;
+
+  if (NMacros > 0 && strcmp(Macros[NMacros - 1].name, name) == 0)
+    m = &Macros[NMacros - 1];   // Carries on the macro above.
+  else
+  {
+    for (i = 0; i < NMacros; i++)
+      if (strcmp(Macros[i].name, name) == 0)
+      {
+        fprintf(stderr, "%s:%d: macro %s already defined on line %d\n",
+                path, lineno, name, Macros[i].line);
+        return 1;
+      }
+    if (NMacros == MAX_MACROS)
+    {
+      fprintf(stderr, "%s:%d: more than %d macros\n", path, lineno, MAX_MACROS);
+      return 1;
+    }
+    m = &Macros[NMacros++];
+    strcpy(m->name, name);
+    m->line = lineno;
+    m->first = NSteps;
+  }
+
+  for (;;)
+  {
+    while (isspace((unsigned char)*p))
+      p++;
+    if (*p == '\0' || *p == '#')
+      break;
+    if (*p == '"')
+    {
+      for (p++; *p != '"' && *p != '\0' && *p != '\n'; p++)
+      {
+        char c = *p;
+
+        if (c == '\\')
+        {
+          switch (*++p)
+          {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case '\\': c = '\\'; break;
+          case '"': c = '"'; break;
+          default:
+            fprintf(stderr, "%s:%d: unknown escape in string\n", path, lineno);
+            return errors + 1;
+          }
+        }
+        errors += AddCharacter(path, lineno, c);
+      }
+      if (*p != '"')
+      {
+        fprintf(stderr, "%s:%d: unterminated string\n", path, lineno);
+        return errors + 1;
+      }
+      p++;
+    }
+    else if (*p == '{')
+    {
+      char *end = strchr(p, '}');
+
+      if (end == NULL)
+      {
+        fprintf(stderr, "%s:%d: unterminated {\n", path, lineno);
+        return errors + 1;
+      }
+      *end = '\0';
+      errors += AddBraced(path, lineno, p + 1);
+      p = end + 1;
+    }
+    else
+    {
+      fprintf(stderr, "%s:%d: expected a \"string\" or {key}\n", path, lineno);
+      return errors + 1;
+    }
+  }
+  m->nsteps = NSteps - m->first;
+  if (m->nsteps == 0 && errors == 0)
+  {
+    fprintf(stderr, "%s:%d: macro %s is empty\n", path, lineno, name);
+    errors++;
+  }
+  return errors;
+}
+
+static int FindMacro(const char *name)
+{
+  int i;
+
+  for (i = 0; i < NMacros; i++)
+    if (strcmp(Macros[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+// Reads one layer file into Entries[layer]; returns the number of errors,
+// or -1 if the file cannot be opened.
+static int ReadLayer(const char *path, int layer)
+{
+  FILE *in;
+  char buf[MAX_LINE];
+  int lineno = 0, errors = 0, pos;
+
+  in = fopen(path, "r");
+  if (in == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(buf, sizeof(buf), in) != NULL)
+  {
+    char posText[16], usage[64], shift[32], flag[16];
+    char *comment;
+    int fields;
+
+    lineno++;
+    if (strchr(buf, '\n') == NULL && !feof(in))
+    {
+      fprintf(stderr, "%s:%d: line longer than %d characters\n", path, lineno, MAX_LINE - 2);
+      fclose(in);
+      return errors + 1;
+    }
+    // Macro strings may hold '#', so these lines find their own comment.
+    if (sscanf(buf, "%15s", posText) == 1 && strcmp(posText, "macro") == 0)
+    {
+      if (layer != 0)
+      {
+        fprintf(stderr, "%s:%d: macros belong in the first keymap file\n", path, lineno);
+        errors++;
+      }
+      else
+        errors += ReadMacro(path, lineno, strstr(buf, "macro") + 5);
+      continue;
+    }
+    comment = strchr(buf, '#');
+    if (comment != NULL)
+    {
+      *comment++ = '\0';
+      while (isspace((unsigned char)*comment))
+        comment++;
+      comment[strcspn(comment, "\r\n")] = '\0';
+    }
+
+    fields = sscanf(buf, "%15s %63s %31s %15s", posText, usage, shift, flag);
+    if (fields <= 0)
+      continue;
+    if (strcmp(posText, "chord") == 0)
+    {
+      if (layer != 0)
+      {
+        fprintf(stderr, "%s:%d: chords belong in the first keymap file\n", path, lineno);
+        errors++;
+      }
+      else
+        errors += ReadChord(path, lineno, strstr(buf, "chord") + 5, comment);
+      continue;
+    }
+    if (fields < 3 || (fields == 4 && strcmp(flag, "repeat") != 0))
+    {
+      fprintf(stderr, "%s:%d: expected <position> <usage> <shift> [repeat]\n", path, lineno);
+      errors++;
+      continue;
+    }
+
+    pos = ParsePosition(posText);
+    if (pos < 0)
+    {
+      fprintf(stderr, "%s:%d: bad position '%s' (octal 000..177)\n", path, lineno, posText);
+      errors++;
+      continue;
+    }
+    if (Entries[layer][pos].line != 0)
+    {
+      fprintf(stderr, "%s:%d: position %03o already defined on line %d\n",
+              path, lineno, pos, Entries[layer][pos].line);
+      errors++;
+      continue;
+    }
+    if (strncmp(shift, "LAYER_", 6) == 0 &&
+        (shift[6] < '1' || shift[6] >= '0' + NLayers || shift[7] != '\0'))
+    {
+      fprintf(stderr, "%s:%d: %s names a layer that is not given\n", path, lineno, shift);
+      errors++;
+      continue;
+    }
+
+    if (fields == 4 && strcmp(shift, "-") != 0)
+    {
+      fprintf(stderr, "%s:%d: only keys without a shift can repeat\n", path, lineno);
+      errors++;
+      continue;
+    }
+
+    Entries[layer][pos].line = lineno;
+    Entries[layer][pos].repeat = (fields == 4);
+    strcpy(Entries[layer][pos].usage, usage);
+    strcpy(Entries[layer][pos].shift, shift);
+    if (comment != NULL)
+      snprintf(Entries[layer][pos].comment, sizeof(Entries[layer][pos].comment), "%s", comment);
+  }
+  fclose(in);
+  return errors;
+}
+
+static void WriteChords(void)
+{
+  int pos, i, n;
+
+  // Bit n of ChordMask[pos] is set if pos is in chord n, and bit n of
+  // ChordsBySize[k] if chord n has k positions.
+  printf("\nstatic const uint8_t ChordMask[%d] PROGMEM = {", NKEYS);
+  for (pos = 0; pos < NKEYS; pos++)
+  {
+    int mask = 0;
+
+    for (i = 0; i < NChords; i++)
+      for (n = 0; n < Chords[i].npos; n++)
+        if (Chords[i].pos[n] == pos)
+          mask |= 1 << i;
+    if (pos % 8 == 0)
+      printf("\n  /* %03o */", pos);
+    printf(" 0x%02x,", mask);
+  }
+  printf("\n};\n\n");
+  printf("static const uint8_t ChordsBySize[%d] PROGMEM = {", MAX_CHORD_KEYS + 1);
+  for (n = 0; n <= MAX_CHORD_KEYS; n++)
+  {
+    int mask = 0;
+
+    for (i = 0; i < NChords; i++)
+      if (Chords[i].npos == n)
+        mask |= 1 << i;
+    printf(" 0x%02x,", mask);
+  }
+  printf(" };\n\n");
+  printf("static const KeyEntry ChordEntries[KEY_CHORDS] PROGMEM = {\n");
+  for (i = 0; i < NChords; i++)
+  {
+    const Chord *c = &Chords[i];
+    char usage[96];
+
+    if (strcmp(c->usage, "NONE") == 0)
+      strcpy(usage, "0");
+    else
+      snprintf(usage, sizeof(usage), "HID_KEYBOARD_SC_%s", c->usage);
+    printf("  /*");
+    for (n = 0; n < c->npos; n++)
+      printf(" %03o", c->pos[n]);
+    printf(" */ KEY_ENTRY(%s, %s),", usage, strcmp(c->shift, "-") == 0 ? "NONE" : c->shift);
+    if (c->comment[0] != '\0')
+      printf(" // %s", c->comment);
+    printf("\n");
+  }
+  printf("};\n");
+}
+
+// Steps of all macros back to back, each ended by MACRO_END, and where
+// each one starts.
+static void WriteMacros(void)
+{
+  int i, n, offset = 0;
+
+  printf("\nstatic const uint8_t MacroSteps[] PROGMEM = {\n");
+  for (i = 0; i < NMacros; i++)
+  {
+    Macro *m = &Macros[i];
+
+    m->offset = offset;
+    printf("  /* %d: %s */\n", i, m->name);
+    for (n = 0; n < m->nsteps; n++)
+    {
+      const Step *step = &Steps[m->first + n];
+
+      printf("    %-60s // %s\n", step->code, step->text);
+      offset += step->bytes;
+    }
+    printf("    MACRO_END,\n");
+    offset++;
+  }
+  printf("};\n\n");
+  printf("static const uint16_t MacroStart[KEY_MACROS] PROGMEM = {");
+  for (i = 0; i < NMacros; i++)
+    printf(" %d,", Macros[i].offset);
+  printf(" };\n");
+}
+
+int main(int argc, char **argv)
+{
+  int errors = 0, layer, pos;
+
+  if (argc < 2 || argc > 1 + MAX_LAYERS)
+  {
+    fprintf(stderr, "usage: %s keymap.txt [layer1.txt [layer2.txt [layer3.txt]]] > keymap.h\n",
+            argv[0]);
+    return 2;
+  }
+  NLayers = argc - 1;
+
+  for (layer = 0; layer < NLayers; layer++)
+  {
+    int n = ReadLayer(argv[1 + layer], layer);
+
+    if (n < 0)
+      return 2;
+    errors += n;
+  }
+
+  for (pos = 0; pos < NKEYS; pos++)
+  {
+    if (Entries[0][pos].line == 0)
+    {
+      fprintf(stderr, "%s: position %03o missing\n", argv[1], pos);
+      errors++;
+    }
+  }
+  for (layer = 0; layer < NLayers; layer++)
+    for (pos = 0; pos < NKEYS; pos++)
+    {
+      const Entry *e = &Entries[layer][pos];
+
+      if (e->line != 0 && strcmp(e->shift, "MACRO") == 0 && FindMacro(e->usage) < 0)
+      {
+        fprintf(stderr, "%s:%d: no macro named %s\n", argv[1 + layer], e->line, e->usage);
+        errors++;
+      }
+    }
+  if (errors)
+    return 1;
+
+  printf("/* Generated by tools/keymapgen from");
+  for (layer = 0; layer < NLayers; layer++)
+    printf(" %s", argv[1 + layer]);
+  printf(". Do not edit. */\n\n");
+  printf("#define KEY_LAYERS %d\n", NLayers);
+  printf("#define KEY_CHORDS %d\n", NChords);
+  printf("#define KEY_MACROS %d\n\n", NMacros);
+  printf("static const KeyEntry Keys[KEY_LAYERS][%d] PROGMEM = {\n", NKEYS);
+  for (layer = 0; layer < NLayers; layer++)
+  {
+    printf("  { /* layer %d: %s */\n", layer, argv[1 + layer]);
+    for (pos = 0; pos < NKEYS; pos++)
+    {
+      const Entry *e = &Entries[layer][pos];
+      char usage[96];
+
+      if (e->line == 0)
+        e = &Entries[0][pos];   // Not given in this layer.
+      if (strcmp(e->usage, "NONE") == 0)
+        strcpy(usage, "0");
+      else if (strcmp(e->shift, "MACRO") == 0)
+        snprintf(usage, sizeof(usage), "%d /* %s */", FindMacro(e->usage), e->usage);
+      else
+        snprintf(usage, sizeof(usage), "HID_KEYBOARD_SC_%s", e->usage);
+
+      printf("    /* %03o */ KEY_ENTRY(%s, %s%s),", pos, usage,
+             strcmp(e->shift, "-") == 0 ? "NONE" : e->shift,
+             e->repeat ? " | KEY_AUTO_REPEAT" : "");
+      if (e->comment[0] != '\0')
+        printf(" // %s", e->comment);
+      printf("\n");
+    }
+    printf("  },\n");
+  }
+  printf("};\n");
+
+  if (NChords > 0)
+    WriteChords();
+  if (NMacros > 0)
+    WriteMacros();
+  return 0;
+}
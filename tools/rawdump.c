@@ -0,0 +1,55 @@
+/* ========================================================================
+   $File: rawdump $
+   $Notice: Host tool; prints the firmware's raw event stream. $
+   ======================================================================== */
+
+/*
+  Usage: rawdump /dev/hidrawN | file | -
+
+  Prints one line per event: device time in microseconds, the time since
+  the previous event, the matrix position (octal) and down / up. Lost
+  reports and events the device dropped are summed up at the end.
+
+    cc -o rawdump tools/rawdump.c tools/rawevents.c
+*/
+
+#include <stdio.h>
+
+#include "rawevents.h"
+
+int main(int argc, char **argv)
+{
+  RawEventsReader reader;
+  RawEventsEvent events[RAWEVENTS_PER_REPORT];
+  unsigned long long last = 0;
+  unsigned long total = 0;
+  int status, n, i;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s /dev/hidrawN | file | -\n", argv[0]);
+    return 2;
+  }
+  if (RawEvents_Open(&reader, argv[1]) != 0)
+    return 2;
+
+  while ((status = RawEvents_Read(&reader, events, &n)) > 0)
+  {
+    for (i = 0; i < n; i++)
+    {
+      printf("%14llu %+10lld  %03o %s\n", (unsigned long long)events[i].usec,
+             total ? (long long)(events[i].usec - last) : 0LL,
+             events[i].position, events[i].released ? "up" : "down");
+      last = events[i].usec;
+      total++;
+    }
+    fflush(stdout);
+  }
+  if (status < 0)
+    fprintf(stderr, "%s: read error or unknown report version\n", argv[1]);
+
+  fprintf(stderr, "%lu events, %lu reports lost, %lu events dropped\n",
+          total, reader.lostReports, reader.droppedEvents);
+  RawEvents_Close(&reader);
+  return status < 0;
+}
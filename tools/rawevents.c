@@ -0,0 +1,89 @@
+/* ========================================================================
+   $File: rawevents $
+   $Notice: Host library; reads the firmware's raw event stream. $
+   ======================================================================== */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rawevents.h"
+
+#define HEADER_SIZE 4
+#define EVENT_SIZE 5
+
+int RawEvents_Open(RawEventsReader *reader, const char *path)
+{
+  memset(reader, 0, sizeof(*reader));
+  if (strcmp(path, "-") == 0)
+    reader->fd = 0;
+  else
+    reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// hidraw returns one report per read; a file or pipe may need several.
+static int ReadReport(int fd, uint8_t *buf)
+{
+  int have = 0;
+
+  while (have < RAWEVENTS_REPORT_SIZE)
+  {
+    ssize_t n = read(fd, buf + have, RAWEVENTS_REPORT_SIZE - have);
+
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      return have == 0 ? 0 : -1;
+    have += (int)n;
+  }
+  return 1;
+}
+
+int RawEvents_Read(RawEventsReader *reader, RawEventsEvent *events, int *count)
+{
+  uint8_t buf[RAWEVENTS_REPORT_SIZE];
+  int status, i;
+
+  status = ReadReport(reader->fd, buf);
+  if (status <= 0)
+    return status;
+  if (buf[0] != RAWEVENTS_VERSION || buf[2] > RAWEVENTS_PER_REPORT)
+    return -1;
+
+  if (reader->started && buf[1] != reader->sequence)
+    reader->lostReports += (uint8_t)(buf[1] - reader->sequence);
+  reader->started = 1;
+  reader->sequence = (uint8_t)(buf[1] + 1);
+  reader->droppedEvents += buf[3];
+
+  *count = buf[2];
+  for (i = 0; i < *count; i++)
+  {
+    const uint8_t *e = buf + HEADER_SIZE + i * EVENT_SIZE;
+    uint32_t usec = (uint32_t)e[1] | ((uint32_t)e[2] << 8) |
+                    ((uint32_t)e[3] << 16) | ((uint32_t)e[4] << 24);
+
+    if (usec < reader->lastUsec)
+      reader->usecBase += (uint64_t)1 << 32;
+    reader->lastUsec = usec;
+
+    events[i].position = e[0] & 0x7F;
+    events[i].released = (e[0] & 0x80) != 0;
+    events[i].usec = reader->usecBase + usec;
+  }
+  return 1;
+}
+
+void RawEvents_Close(RawEventsReader *reader)
+{
+  if (reader->fd > 0)
+    close(reader->fd);
+  reader->fd = -1;
+}
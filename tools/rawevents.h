@@ -0,0 +1,50 @@
+/* ========================================================================
+   $File: rawevents $
+   $Notice: Host library; reads the firmware's raw event stream. $
+   ======================================================================== */
+
+#ifndef RAWEVENTS_H
+#define RAWEVENTS_H
+
+#include <stdint.h>
+
+/*
+  Reads the reports of the -DRAW_EVENTS interface, from its hidraw node or
+  from a file or pipe of back-to-back reports (such as the host build's
+  "rawevents <trace>" output), and returns them as events. The layout
+  matches RawEventsReport_t in the firmware.
+*/
+
+#define RAWEVENTS_VERSION 1
+#define RAWEVENTS_REPORT_SIZE 64
+#define RAWEVENTS_PER_REPORT 12
+
+typedef struct
+{
+  uint8_t position;             // Matrix position, 0..127.
+  uint8_t released;             // 1 for a release, 0 for a press.
+  uint64_t usec;                // Device time, unwrapped.
+} RawEventsEvent;
+
+typedef struct
+{
+  int fd;
+  int started;                  // A report has been seen.
+  uint8_t sequence;             // Expected next Sequence.
+  uint32_t lastUsec;
+  uint64_t usecBase;            // Added to the 32-bit device time.
+  unsigned long lostReports;    // Sequence gaps.
+  unsigned long droppedEvents;  // Reported by the device.
+} RawEventsReader;
+
+// path is a hidraw node, a file, or "-" for stdin. Returns 0 or -1.
+int RawEvents_Open(RawEventsReader *reader, const char *path);
+
+// Reads one report into events (room for RAWEVENTS_PER_REPORT) and sets
+// *count; a report may carry no events, only a drop count. Returns 1, 0 at
+// end of input, or -1 on an error or a report of another version.
+int RawEvents_Read(RawEventsReader *reader, RawEventsEvent *events, int *count);
+
+void RawEvents_Close(RawEventsReader *reader);
+
+#endif
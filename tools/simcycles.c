@@ -0,0 +1,420 @@
+/* ========================================================================
+   $File: simcycles $
+   $Notice: Host tool; cycle counts for the firmware under simavr. $
+   ======================================================================== */
+
+/*
+  Usage: simcycles firmware.elf trace [budgets]
+
+  Runs a -DSIM_BUILD image of the firmware under simavr on an ATmega32U4
+  at 16 MHz, and feeds it a scan trace (see tools/tracegen) through a
+  virtual matrix. The wiring comes from the same board description as
+  the firmware's: column select and strobe are taken from writes to
+  SC_ADDR_PORT and SC_STROBE_PORT, and the selected column's snapshot is
+  driven onto the SC_KEYS_PIN port. The trace advances one sample per
+  call of Direct_Scan.
+
+  For each measured function it prints calls and min / avg / max cycles
+  from entry to return, interrupts included. The budgets file holds lines
+  of
+
+    <function> <max cycles> [# comment]
+
+  and the tool exits 1 if any function's max exceeds its budget. A
+  function missing from the ELF symbol table (inlined or compiled out) is
+  reported and skipped.
+
+  It also prints the cycle, and time, of the first call of each boot
+  probe mark: the image stands in for USB configuration on its first
+  main loop pass and then polls, so these give reset to configured and
+  reset to first report.
+
+  Build against simavr and libelf, with the firmware's BOARD if it is not
+  the default:
+
+    cc -I. -o simcycles tools/simcycles.c -lsimavr -lelf
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/avr_ioport.h>
+
+// The board header names ports by their registers; here they stand for
+// the port letters simavr uses.
+#define PORTB 'B'
+#define PORTC 'C'
+#define PORTD 'D'
+#define PORTE 'E'
+#define PORTF 'F'
+#define PINB 'B'
+#define PINC 'C'
+#define PIND 'D'
+#define PINE 'E'
+#define PINF 'F'
+
+#ifndef BOARD
+#define BOARD "boards/microswitch.h"
+#endif
+#include BOARD
+
+#define MCU "atmega32u4"
+#define MCU_HZ 16000000UL
+#define MAX_DEPTH 16
+
+typedef struct
+{
+  const char *name;
+  uint32_t addr;                // Byte address; 0 if not in the image.
+  unsigned long calls;
+  avr_cycle_count_t min, max, total;
+  unsigned long budget;         // 0 = none.
+} Function;
+
+static Function Functions[] =
+{
+  { .name = "Direct_Scan" },
+  { .name = "KeyDown" },
+  { .name = "KeyUp" },
+  { .name = "AddKeyReport" },
+  { .name = "AddNKROReport" },
+  { .name = "CALLBACK_HID_Device_CreateHIDReport" },
+  { .name = "CALLBACK_HID_Device_ProcessHIDReport" },
+};
+#define NFUNCTIONS (sizeof(Functions) / sizeof(Functions[0]))
+
+// Boot probe marks, timed from reset to their first call.
+typedef struct
+{
+  const char *name;
+  uint32_t addr;
+  avr_cycle_count_t cycle;      // 0 = not reached.
+} Milestone;
+
+static Milestone Milestones[] =
+{
+  { .name = "Boot_Configured" },
+  { .name = "Boot_Reported" },
+};
+#define NMILESTONES (sizeof(Milestones) / sizeof(Milestones[0]))
+
+typedef struct
+{
+  Function *fn;
+  avr_cycle_count_t start;
+  uint16_t sp;
+} Frame;
+
+static Frame Stack[MAX_DEPTH];
+static int Depth;
+
+// Trace samples, as in the firmware's TraceSample.
+typedef struct
+{
+  uint16_t scans;
+  uint8_t matrix[16];
+} Sample;
+
+static Sample *Samples;
+static long NSamples, NextSample;
+static unsigned Pending;        // Scans left before NextSample applies.
+static uint8_t Matrix[16];
+
+static uint8_t AddrPort, StrobePort;
+static avr_irq_t *KeyPins[8];
+
+static int Get16(FILE *in, uint16_t *v)
+{
+  int lo = getc(in), hi = getc(in);
+
+  if (lo == EOF || hi == EOF)
+    return 0;
+  *v = (uint16_t)(lo | (hi << 8));
+  return 1;
+}
+
+static int ReadTrace(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  char magic[4];
+  long size = 0;
+
+  if (in == NULL)
+  {
+    perror(path);
+    return 0;
+  }
+  if (fread(magic, 1, 4, in) != 4 || memcmp(magic, "MKT1", 4) != 0)
+  {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    fclose(in);
+    return 0;
+  }
+  for (;;)
+  {
+    uint16_t ticks;
+
+    if (NSamples == size)
+    {
+      size = size ? 2 * size : 1024;
+      Samples = realloc(Samples, size * sizeof(Sample));
+      if (Samples == NULL)
+      {
+        perror("realloc");
+        exit(2);
+      }
+    }
+    if (!Get16(in, &ticks) || !Get16(in, &Samples[NSamples].scans) ||
+        fread(Samples[NSamples].matrix, 1, 16, in) != 16)
+      break;
+    if (Samples[NSamples].scans == 0)
+    {
+      fprintf(stderr, "%s: sample %ld has no scans\n", path, NSamples);
+      fclose(in);
+      return 0;
+    }
+    NSamples++;
+  }
+  fclose(in);
+  return 1;
+}
+
+static int ReadBudgets(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  char buf[256], name[128];
+  unsigned long budget;
+  int lineno = 0, errors = 0;
+  unsigned i;
+
+  if (in == NULL)
+  {
+    perror(path);
+    return 0;
+  }
+  while (fgets(buf, sizeof(buf), in) != NULL)
+  {
+    char *comment = strchr(buf, '#');
+    int fields;
+
+    lineno++;
+    if (comment != NULL)
+      *comment = '\0';
+    fields = sscanf(buf, "%127s %lu", name, &budget);
+    if (fields <= 0)
+      continue;
+    for (i = 0; i < NFUNCTIONS; i++)
+      if (strcmp(Functions[i].name, name) == 0)
+        break;
+    if (fields != 2 || i == NFUNCTIONS)
+    {
+      fprintf(stderr, "%s:%d: expected <function> <max cycles>\n", path, lineno);
+      errors++;
+      continue;
+    }
+    Functions[i].budget = budget;
+  }
+  fclose(in);
+  return errors == 0;
+}
+
+// Drive the key pins from the column the firmware has selected and
+// strobed.
+static void UpdatePins(void)
+{
+  uint8_t column = (AddrPort >> SC_ADDR_SHIFT) & SC_ADDR_MASK & 0x0F;
+  uint8_t keys = (StrobePort & SC_STROBE) ? 0xFF : Matrix[column];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    avr_raise_irq(KeyPins[i], (keys >> i) & 1);
+}
+
+// A write to the address port, the strobe port, or both if they are one.
+static void PortWrite(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  char port = (char)(intptr_t)param;
+
+  (void)irq;
+  if (port == SC_ADDR_PORT)
+    AddrPort = (uint8_t)value;
+  if (port == SC_STROBE_PORT)
+    StrobePort = (uint8_t)value;
+  UpdatePins();
+}
+
+// Called at each entry to Direct_Scan; returns 0 once the trace is done.
+static int NextScan(void)
+{
+  if (Pending == 0)
+  {
+    if (NextSample == NSamples)
+      return 0;
+    Pending = Samples[NextSample].scans;
+  }
+  if (--Pending == 0)
+  {
+    memcpy(Matrix, Samples[NextSample].matrix, sizeof(Matrix));
+    NextSample++;
+    UpdatePins();
+  }
+  return 1;
+}
+
+static uint16_t StackPointer(avr_t *avr)
+{
+  return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+int main(int argc, char **argv)
+{
+  elf_firmware_t firmware;
+  avr_t *avr;
+  int state, failed = 0, i;
+  unsigned f;
+
+  if (argc < 3 || argc > 4)
+  {
+    fprintf(stderr, "usage: %s firmware.elf trace [budgets]\n", argv[0]);
+    return 2;
+  }
+  if (!ReadTrace(argv[2]) || (argc > 3 && !ReadBudgets(argv[3])))
+    return 2;
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[1], &firmware) != 0)
+  {
+    fprintf(stderr, "%s: cannot load\n", argv[1]);
+    return 2;
+  }
+  for (f = 0; f < NFUNCTIONS; f++)
+  {
+    for (i = 0; i < (int)firmware.symbolcount; i++)
+      if (strcmp(firmware.symbol[i]->symbol, Functions[f].name) == 0)
+        Functions[f].addr = firmware.symbol[i]->addr;
+    Functions[f].min = ~(avr_cycle_count_t)0;
+  }
+  for (f = 0; f < NMILESTONES; f++)
+    for (i = 0; i < (int)firmware.symbolcount; i++)
+      if (strcmp(firmware.symbol[i]->symbol, Milestones[f].name) == 0)
+        Milestones[f].addr = firmware.symbol[i]->addr;
+
+  avr = avr_make_mcu_by_name(MCU);
+  if (avr == NULL)
+  {
+    fprintf(stderr, "simavr has no %s core\n", MCU);
+    return 2;
+  }
+  avr_init(avr);
+  avr->frequency = MCU_HZ;
+  avr_load_firmware(avr, &firmware);
+
+  memset(Matrix, 0xFF, sizeof(Matrix));
+  for (i = 0; i < 8; i++)
+    KeyPins[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(SC_KEYS_PIN), i);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(SC_ADDR_PORT),
+                                        IOPORT_IRQ_REG_PORT),
+                          PortWrite, (void *)(intptr_t)SC_ADDR_PORT);
+  if (SC_STROBE_PORT != SC_ADDR_PORT)
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(SC_STROBE_PORT),
+                                          IOPORT_IRQ_REG_PORT),
+                            PortWrite, (void *)(intptr_t)SC_STROBE_PORT);
+  StrobePort = SC_STROBE;       // The firmware idles it high.
+  UpdatePins();
+
+  for (;;)
+  {
+    uint16_t sp;
+
+    state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed)
+      break;
+
+    // Returns: the stack is back above the frame's entry SP.
+    sp = StackPointer(avr);
+    while (Depth > 0 && sp > Stack[Depth - 1].sp)
+    {
+      Frame *frame = &Stack[--Depth];
+      avr_cycle_count_t cycles = avr->cycle - frame->start;
+
+      frame->fn->calls++;
+      frame->fn->total += cycles;
+      if (cycles < frame->fn->min) frame->fn->min = cycles;
+      if (cycles > frame->fn->max) frame->fn->max = cycles;
+    }
+
+    for (f = 0; f < NMILESTONES; f++)
+      if (Milestones[f].cycle == 0 && Milestones[f].addr != 0 &&
+          avr->pc == Milestones[f].addr)
+        Milestones[f].cycle = avr->cycle;
+
+    for (f = 0; f < NFUNCTIONS; f++)
+    {
+      if (Functions[f].addr == 0 || avr->pc != Functions[f].addr)
+        continue;
+      if (f == 0 && !NextScan())
+        goto done;
+      if (Depth < MAX_DEPTH)
+      {
+        Stack[Depth].fn = &Functions[f];
+        Stack[Depth].start = avr->cycle;
+        Stack[Depth].sp = sp;
+        Depth++;
+      }
+    }
+  }
+  fprintf(stderr, "simulation stopped (state %d) after %ld of %ld samples\n",
+          state, NextSample, NSamples);
+  failed = 1;
+
+done:
+  printf("%-40s %8s %8s %8s %8s %8s\n", "function", "calls", "min", "avg", "max", "budget");
+  for (f = 0; f < NFUNCTIONS; f++)
+  {
+    Function *fn = &Functions[f];
+
+    if (fn->addr == 0)
+    {
+      printf("%-40s not in symbol table\n", fn->name);
+      continue;
+    }
+    if (fn->calls == 0)
+    {
+      printf("%-40s %8lu\n", fn->name, 0UL);
+      continue;
+    }
+    printf("%-40s %8lu %8lu %8lu %8lu", fn->name, fn->calls,
+           (unsigned long)fn->min, (unsigned long)(fn->total / fn->calls),
+           (unsigned long)fn->max);
+    if (fn->budget != 0)
+    {
+      printf(" %8lu", fn->budget);
+      if (fn->max > fn->budget)
+      {
+        printf("  OVER");
+        failed = 1;
+      }
+    }
+    printf("\n");
+  }
+
+  printf("\n%-40s %12s %10s\n", "boot", "cycles", "us");
+  for (f = 0; f < NMILESTONES; f++)
+  {
+    Milestone *m = &Milestones[f];
+
+    if (m->addr == 0)
+      printf("%-40s not in symbol table\n", m->name);
+    else if (m->cycle == 0)
+      printf("%-40s not reached\n", m->name);
+    else
+      printf("%-40s %12lu %10lu\n", m->name, (unsigned long)m->cycle,
+             (unsigned long)(m->cycle / (MCU_HZ / 1000000UL)));
+  }
+  return failed;
+}
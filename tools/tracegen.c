@@ -0,0 +1,181 @@
+/* ========================================================================
+   $File: tracegen $
+   $Notice: Host tool; writes synthetic scan traces for the replayer. $
+   ======================================================================== */
+
+/*
+  Usage: tracegen bounce|roll|chord [repeats] > file.trace
+
+  Writes a trace in the format the firmware records with -DTRACE_RECORD:
+  the four bytes "MKT1", then 20-byte samples of
+
+    <ticks:16> <scans:16> <matrix:16 bytes>
+
+  little-endian, one sample per change of the raw matrix. The matrix is
+  active low, one byte per column, bit n for row n. Scans are assumed to
+  run at 1 kHz with the F_CPU/8 tick at 16 MHz.
+
+    bounce  one key at a time, pressed and released with 1..5 bounces
+    roll    eight-key rolls, each key overlapping the next
+    chord   ten keys pressed within three scans, held, then released
+
+  The sequences come from a fixed seed, so the same arguments always
+  produce the same file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 126               // Positions 0176 and 0177 are unmapped.
+#define SCAN_TICKS 2000
+
+static unsigned char Matrix[16], Last[16];
+static unsigned Pending;        // Scans since the last sample written.
+static int Started;             // The first sample has been written.
+static unsigned Ticks;
+static unsigned long Seed = 1;
+
+static unsigned Random(unsigned n)
+{
+  Seed = Seed * 1103515245UL + 12345UL;
+  return (unsigned)((Seed >> 16) & 0x7FFF) % n;
+}
+
+static void Put16(unsigned v)
+{
+  putchar(v & 0xFF);
+  putchar((v >> 8) & 0xFF);
+}
+
+// Writes the current Matrix as a sample covering the Pending scans.
+static void Put(void)
+{
+  Put16(Ticks);
+  Put16(Pending);
+  fwrite(Matrix, 1, sizeof(Matrix), stdout);
+  memcpy(Last, Matrix, sizeof(Matrix));
+  Pending = 0;
+  Started = 1;
+}
+
+// One scan of the current Matrix; written out if it changed, or if it is
+// the first.
+static void Scan(void)
+{
+  Pending++;
+  if (!Started || Pending == 0xFFFF || memcmp(Matrix, Last, sizeof(Matrix)) != 0)
+    Put();
+  Ticks += SCAN_TICKS;
+}
+
+static void Scans(unsigned n)
+{
+  while (n-- > 0)
+    Scan();
+}
+
+static void Set(unsigned pos, int down)
+{
+  if (down)
+    Matrix[pos >> 3] &= ~(1 << (pos & 7));
+  else
+    Matrix[pos >> 3] |= 1 << (pos & 7);
+}
+
+static void Bounce(unsigned pos, int down)
+{
+  unsigned n = 1 + Random(5);
+
+  while (n-- > 0)
+  {
+    Set(pos, down);
+    Scan();
+    Set(pos, !down);
+    Scan();
+  }
+  Set(pos, down);
+}
+
+static void GenBounce(void)
+{
+  unsigned pos = Random(NKEYS);
+
+  Bounce(pos, 1);
+  Scans(30);
+  Bounce(pos, 0);
+  Scans(30);
+}
+
+static void GenRoll(void)
+{
+  unsigned first = Random(NKEYS - 8), i;
+
+  for (i = 0; i < 8; i++)
+  {
+    Set(first + i, 1);
+    if (i > 0)
+      Set(first + i - 1, 0);
+    Scans(2 + Random(4));
+  }
+  Set(first + 7, 0);
+  Scans(30);
+}
+
+static void GenChord(void)
+{
+  unsigned keys[10], i;
+
+  for (i = 0; i < 10; i++)
+    keys[i] = (Random(NKEYS / 10) * 10 + i) % NKEYS;
+  for (i = 0; i < 10; i++)
+  {
+    Set(keys[i], 1);
+    if (i % 4 == 3)
+      Scan();
+  }
+  Scans(40);
+  for (i = 0; i < 10; i++)
+  {
+    Set(keys[i], 0);
+    if (i % 4 == 3)
+      Scan();
+  }
+  Scans(40);
+}
+
+int main(int argc, char **argv)
+{
+  void (*gen)(void);
+  long repeats, i;
+
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(stderr, "usage: %s bounce|roll|chord [repeats] > file.trace\n", argv[0]);
+    return 2;
+  }
+  if (strcmp(argv[1], "bounce") == 0)
+    gen = GenBounce;
+  else if (strcmp(argv[1], "roll") == 0)
+    gen = GenRoll;
+  else if (strcmp(argv[1], "chord") == 0)
+    gen = GenChord;
+  else
+  {
+    fprintf(stderr, "%s: unknown generator '%s'\n", argv[0], argv[1]);
+    return 2;
+  }
+  repeats = argc > 2 ? atol(argv[2]) : 100;
+
+  memset(Matrix, 0xFF, sizeof(Matrix));
+  fwrite("MKT1", 1, 4, stdout);
+  Scans(10);
+  for (i = 0; i < repeats; i++)
+    gen();
+  if (Pending != 0)
+  {
+    Ticks -= SCAN_TICKS;        // Scans left unchanged at the end.
+    Put();
+  }
+  return 0;
+}